@@ -0,0 +1,31 @@
+# Helpers of the benchmarks, sourced by bench/*.sh with the shell to test in
+# $TASH, ./tash by default, run from the top of the tree by 'make bench'.
+
+TASH=${TASH:-./tash}
+case $TASH in
+  /*) ;;
+  *) TASH=$(pwd)/$TASH ;;
+esac
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# Time in nanoseconds
+now() {
+  date +%s%N
+}
+
+# Value of counter $1 in the JSON of 'stats -j' in file $2
+stat_of() {
+  sed -n "s/.*\"$1\":\([0-9]*\).*/\1/p" "$2"
+}
+
+# Print a result line: name, nanoseconds, count, and the counters per item
+report() {
+  name=$1 ns=$2 n=$3 st=$4
+  printf '%-28s %8d ms %10d ns/item' "$name" $((ns / 1000000)) $((ns / n))
+  for c in reads forks waits; do
+    v=$(stat_of $c "$st")
+    [ -n "$v" ] && printf ' %s/item %s' $c "$(awk "BEGIN { printf \"%.3f\", $v / $n }")"
+  done
+  printf '\n'
+}
@@ -0,0 +1,21 @@
+# 400 commands started in background, without a cap and with 'set maxjobs'
+# of 8 and 32, then waited for.
+
+. bench/common.sh
+
+for max in 0 8 32; do
+  {
+    echo "set maxjobs $max"
+    i=0
+    while [ $i -lt 400 ]; do
+      echo "/bin/sleep 0.01 &"
+      i=$((i + 1))
+    done
+    echo "wait"
+    echo "stats -j > $TMP/st"
+  } > $TMP/jobs
+  t0=$(now)
+  $TASH $TMP/jobs > /dev/null
+  report "maxjobs $max" $(($(now) - t0)) 400 $TMP/st
+  echo "  job_waits $(stat_of job_waits $TMP/st) fork_retries $(stat_of fork_retries $TMP/st)"
+done
@@ -0,0 +1,27 @@
+# Lexer throughput on lines of up to 750 bytes, near what LINSIZ allows: a
+# few long words, where runs of ordinary characters are skipped in bulk, and
+# many short words with quotes, each 20000 lines of ':' given through a pipe,
+# which the shell reads by lines.
+
+. bench/common.sh
+
+N=20000
+awk -v n=$N 'BEGIN {
+  w = sprintf("%240s", ""); gsub(/ /, "abcdefgh", w); w = substr(w, 1, 240)
+  for (i = 0; i < n; i++) printf ": %s \"%s\" %s\n", w, w, w
+  print "stats -j > '$TMP'/st" }' > $TMP/long
+awk -v n=$N 'BEGIN {
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 90; j++) printf j ? " w%d\x27q\x27" : ": w%d", j
+    printf "\n"
+  }
+  print "stats -j > '$TMP'/st" }' > $TMP/short
+
+for f in long short; do
+  size=$(wc -c < $TMP/$f)
+  t0=$(now)
+  cat $TMP/$f | $TASH /dev/stdin
+  ns=$(($(now) - t0))
+  report "lexer, $f words" $ns $N $TMP/st
+  echo "  $((size * 1000 / ns)) MB/s"
+done
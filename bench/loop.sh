@@ -0,0 +1,21 @@
+# Loops run from the parsed tree: time and counters per iteration of a for
+# loop of 10000 iterations of ':', and of 1000 of /bin/true.
+
+. bench/common.sh
+
+D="0 1 2 3 4 5 6 7 8 9"
+cat > $TMP/loop <<END
+for a in $D; do for b in $D; do for c in $D; do for d in $D; do : \$a\$b\$c\$d; done; done; done; done
+stats -j > $TMP/st
+END
+t0=$(now)
+$TASH $TMP/loop
+report "for, ':' body" $(($(now) - t0)) 10000 $TMP/st
+
+cat > $TMP/loop <<END
+for a in $D; do for b in $D; do for c in $D; do /bin/true; done; done; done
+stats -j > $TMP/st
+END
+t0=$(now)
+$TASH $TMP/loop
+report "for, /bin/true body" $(($(now) - t0)) 1000 $TMP/st
@@ -0,0 +1,18 @@
+# Throughput of a pipeline of external commands moving 512m through two
+# pipes, with the capacity of the pipes given by 'set pipesize', 0 for the
+# default of the kernel.
+
+. bench/common.sh
+
+for size in 0 256k 1m 4m; do
+  cat > $TMP/pipe <<END
+set pipesize $size
+head -c 512m /dev/zero | /bin/cat | /bin/cat > /dev/null
+stats -j > $TMP/st
+END
+  t0=$(now)
+  $TASH $TMP/pipe
+  ns=$(($(now) - t0))
+  report "pipesize $size" $ns 1 $TMP/st
+  echo "  $((512 * 1000000000 / ns)) MB/s"
+done
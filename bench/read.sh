@@ -0,0 +1,21 @@
+# 'while read' over a file of a million lines, from the file, where 'read'
+# reads blocks, and from a pipe, where it peeks with tee(2).
+
+. bench/common.sh
+
+N=1000000
+seq $N > $TMP/lines
+cat > $TMP/file <<END
+while read l; do :; done < $TMP/lines
+stats -j > $TMP/st
+END
+cat > $TMP/pipe <<END
+/bin/cat $TMP/lines | while read l; do :; done
+stats -j > $TMP/st
+END
+
+for f in file pipe; do
+  t0=$(now)
+  $TASH $TMP/$f
+  report "read, $f" $(($(now) - t0)) $N $TMP/st
+done
@@ -0,0 +1,13 @@
+# A million commands ':' written into a pipe to the shell, which takes them
+# a line at a time, with the peak size of the shell at the end.
+
+. bench/common.sh
+
+N=1000000
+cat > $TMP/tail <<END
+stats -j > $TMP/st
+sh -c 'grep VmHWM /proc/\$PPID/status'
+END
+t0=$(now)
+{ seq -f ': %g' $N; cat $TMP/tail; } | $TASH /dev/stdin
+report "stream" $(($(now) - t0)) $N $TMP/st
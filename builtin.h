@@ -0,0 +1,38 @@
+/***************************************************
+ *  File: builtin.h -- Interface of built-in commands
+ *                     loaded by 'enable -f'.
+ *
+ *          Author      Year    Description
+ *
+ *   1.  Ken Thompson   1975    Create on Unix V6
+ *   2.  Leo Ma         2013    Porting on Linux
+ *
+ ***************************************************/
+#ifndef _BUILTIN_H
+#define _BUILTIN_H
+
+/* A shared library gives a command 'name' to 'enable -f lib.so name' by
+ * a symbol name_builtin of this structure:
+ *
+ *   static int hello(int argc, char **argv)
+ *   {
+ *     printf("hello %s\n", argc > 1 ? argv[1] : "world");
+ *     return 0;
+ *   }
+ *   struct tash_builtin hello_builtin = { TASH_ABI, "hello", hello };
+ *
+ * built with 'cc -shared -fPIC'. The function is called with the arguments
+ * of the command as main() is, with redirections in place on descriptors
+ * 0, 1 and 2, and returns the exit status. It runs in the shell unless the
+ * command is piped, in background or under timeout, when it runs in a
+ * child forked for it. It must not exit() nor leave descriptors changed.
+ */
+#define TASH_ABI  1
+
+struct tash_builtin {
+  int abi;  // TASH_ABI the library was built with
+  char *name;
+  int (*func)(int argc, char **argv);
+};
+
+#endif
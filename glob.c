@@ -7,26 +7,62 @@
  *   2.  Leo Ma         2013    Porting on Linux
  *
  ***************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
-
-#define E2BIG  7
-#define ENOEXEC  8
-#define ENOENT  2
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <linux/io_uring.h>
 
 #define STDOUT  1
 
-#define STRSIZ  512
+#define STRSIZ  65536
+#define ARGSIZ  1024
+#define QDEPTH  256  // statx submitted at a time
 
-char ab[STRSIZ];
-char *ava[50];
-char **av;
+// Counters of stats in the shell, same as in tash.c
+#define SFORK   0
+#define SEXEC   1
+#define SFAIL   2
+#define SGLOB   3
+#define SDENT   4
+#define SSTAT   9
+#define NSTAT   13
+
+#define COUNT(i, n)  (stats ? __atomic_fetch_add(&stats[i], n, __ATOMIC_RELAXED) : 0)
+
+// String area in chunks which never move
 char *string;
-int errno;
+char *estring;
+
+// Argument vector, ava[0] is for "/bin/sh"
+char **ava;
+char **av;
+char **eav;
+
+// Range of arguments expanded from patterns, kept as offsets
+// since the vector may move
+long fav;
+long lav;
+
 int ncoll;
+int batch;
+int print;
+
+// Counters mapped from the descriptor of option -s
+long *stats;
+
+char *unesc(char *as);
+int isglob(char *s);
+int match(char *str, char *pat);
 
 void toolong()
 {
@@ -34,202 +70,657 @@ void toolong()
   exit(-1);
 }
 
+void nomem()
+{
+  write(STDOUT, "Out of memory\n", 14);
+  exit(-1);
+}
+
 char *cat(char *as1, char *as2)
 {
   char *s1, *s2;
-  char c;
+  int n;
 
-  s2 = string;
-  s1 = as1;
-  while ((c = *s1++) != '\0') {
-    if (s2 > ab + STRSIZ)
-      toolong();
-    c &= 0x7f;
-    if (c == '\0') {
-      *s2++ = '/';  // Recover '/'
-      break;
-    }
-    *s2++ = c;
+  n = strlen(as1) + strlen(as2) + 1;
+  if (string + n > estring) {
+    if ((string = malloc(n > STRSIZ ? n : STRSIZ)) == NULL)
+      nomem();
+    estring = string + (n > STRSIZ ? n : STRSIZ);
   }
 
+  s2 = string;
+  s1 = as1;
+  while ((*s2 = *s1++) != '\0')
+    s2++;
   s1 = as2;
-  do {
-    if (s2 > ab + STRSIZ)
-      toolong();
-    *s2++ = c = *s1++;
-  } while (c != '\0');
+  while ((*s2++ = *s1++) != '\0')
+    continue;
 
   s1 = string;
   string = s2;
   return s1;
 }
 
-int compar(const char *s1, const char *s2)
+void addarg(char *s)
+{
+  int n;
+
+  if (av == eav) {
+    n = eav - ava;
+    if ((ava = realloc(ava, 2 * n * sizeof(char *))) == NULL)
+      nomem();
+    av = ava + n;
+    eav = ava + 2 * n;
+  }
+  *av++ = s;
+}
+
+int compar(const void *p1, const void *p2)
 {
+  const unsigned char *s1, *s2;
   int ret;
+
+  s1 = *(const unsigned char **)p1;
+  s2 = *(const unsigned char **)p2;
   while ((ret = *s1 - *s2++) == 0 && *s1++ != '\0')
     continue;
   return ret;
 }
 
-// Bubble-sort
-void sort(char **oav)
-{
-  char **p1, **p2;
-  char **xchg;
-  char *tmp;
-
-  p2 = av;
-  do {
-    xchg = NULL;
-    for (p1 = oav + 1; p1 < p2; p1++) {
-      if (compar(*(p1 - 1), *p1) > 0) {
-        xchg = p1;
-        tmp = *p1;
-        *p1 = *(p1 - 1);
-        *(p1 - 1) = tmp;
-      }
-    }
-    p2 = xchg;
-  }  while (xchg != NULL);
-}
-
 void execute(char *file, char **args)
 {
+  COUNT(SEXEC, 1);
   execv(file, args);
+  COUNT(SFAIL, 1);
   if (errno == ENOEXEC) {
     args[0] = file;
     *--args = "/bin/sh";  // ava[0]
+    COUNT(SEXEC, 1);
     execv(*args, args);  // re-exec /bin/sh
+    COUNT(SFAIL, 1);
   }
-  if (errno == E2BIG)
+  if (errno == E2BIG && !batch)
     toolong();
 }
 
-int match1(char *str, char *pat)
+// Search the command as the shell does, args[-1] is for "/bin/sh".
+void run(char **args)
 {
-  char s, p, rp, lp;
-  int ok;
-  int match2(char *, char *);
-
-  if ((s = *str++) != '\0')
-    if (!(s & 0x7f))
-      s = 0x80;
-
-  switch (p = *pat++) {
-
-    case '[':
-      lp = 0xff;
-      while ((rp = *pat++) != '\0') {
-        if (rp == ']') {
-          if (ok)
-            return match1(str, pat);
-          else
-            return 0;
-        } else if (rp == '-') {
-          if (s >= lp && s <= *pat++)
-            ok++;
-        } else {
-          if (s == (lp = rp))
-            ok++;  // at least match one char will be ok
-        }
-      }
-      return 0;  // missing ']'
+  char *cp;
 
-    default:
-      if (s != p)  // not match
-        return 0;
+  execute(args[0], args);
+  if (errno == E2BIG)
+    return;
+  cp = cat("/usr/bin/", args[0]);
+  execute(cp + 4, args);
+  if (errno == E2BIG)
+    return;
+  execute(cp, args);
+  if (errno == E2BIG)
+    return;
+  write(STDOUT, "Command not found\n", 19);
+}
 
-    case '?':
-      if (s != '\0')
-        return match1(str, pat);
-      return 0;  // Yet pattern not finished
+int wstat(int status)
+{
+  if (status & 0x7f)
+    return (status & 0x7f) | 0x80;
+  return (status >> 8) & 0xff;
+}
 
-    case '*':
-      return match2(--str, pat);
+/* Run the command once per batch of expanded arguments which fits in ARG_MAX,
+ * with arguments before and after the expanded range repeated in each batch.
+ * At most 'batch' batches run at a time, and the exit status is the highest
+ * one of all batches.
+ */
+int runbatch()
+{
+  char **bv, **p, **q, **f, **l;
+  long max, size, fixed;
+  int n, nrun, ret, status;
+  extern char **environ;
+
+  max = sysconf(_SC_ARG_MAX);
+  if (max <= 0)
+    max = 131072;
+  for (p = environ; *p != NULL; p++)
+    max -= strlen(*p) + 1 + sizeof(char *);
+  max -= 4096;  // Headroom for the loader
+
+  f = ava + fav;
+  l = ava + lav;
+  fixed = 0;
+  for (p = ava + 1; p < av; p++)
+    if (p < f || p >= l)
+      fixed += strlen(*p) + 1 + sizeof(char *);
+
+  if ((bv = malloc((av - ava + 2) * sizeof(char *))) == NULL)
+    nomem();
+
+  nrun = 0;
+  ret = 0;
+  for (p = f; p < l || nrun > 0; ) {
+    // Wait for a slot, or for all when nothing is left.
+    if (nrun >= batch || p == l) {
+      if (wait(&status) == -1)
+        break;
+      nrun--;
+      if (wstat(status) > ret)
+        ret = wstat(status);
+      continue;
+    }
 
-    case '\0':
-      return (s == '\0');  // both finished
+    n = 1;
+    for (q = ava + 1; q < f; q++)
+      bv[n++] = *q;
+    size = fixed;
+    do {
+      size += strlen(*p) + 1 + sizeof(char *);
+      bv[n++] = *p++;
+    } while (p < l && size + strlen(*p) + 1 + sizeof(char *) <= max);
+    for (q = l; q < av; q++)
+      bv[n++] = *q;
+    bv[n] = NULL;
+
+    switch (fork()) {
+      case -1:
+        write(STDOUT, "try again\n", 10);
+        ret = 0xff;
+        p = l;
+        break;
+      case 0:
+        run(bv + 1);
+        exit(-1);
+      default:
+        COUNT(SFORK, 1);
+        nrun++;
+    }
   }
 
-  return 0;
+  return ret;
 }
 
-int match2(char* str, char *pat)
+/* Qualifiers of a pattern, in '(' ')' after it as in zsh:
+ *   . / @ = p    regular files, directories, symbolic links, sockets, fifos
+ *   *            executable regular files
+ *   L[kmg][+-]n  size in bytes, or units, more (+), less (-) or exactly n
+ *   m[wdhms][+-]n  modified n days, or units, ago, more or less
+ *   o[nLm] O[nLm]  sort by name, size or newest first, O reverses
+ */
+struct qual {
+  int type;
+  int exec;
+  int lop;  // '+', '-', '=' or 0 for no size
+  long long lunit;
+  long long lval;
+  int mop;
+  long long munit;
+  long long mval;
+  int key;
+  int rev;
+};
+
+// A path expanded and what is known of it by statx
+struct ent {
+  char *name;
+  int st;  // 1 known, -1 gone, 0 not yet
+  int mode;
+  long long size;
+  long long mtime;
+};
+
+struct qual q;
+
+int qnum(char **qs, int *op, long long *val)
 {
-  if (*pat == '\0')  // '*' is the last char
-    return 1;
-  while (*str != '\0') {
-    if (match1(str++, pat))  // '*' match finished when pattern matched
-      return 1;
+  char *cp;
+
+  *op = '=';
+  if (**qs == '+' || **qs == '-')
+    *op = *(*qs)++;
+  *val = strtoll(*qs, &cp, 10);
+  if (cp == *qs)
+    return 0;
+  *qs = cp;
+  return 1;
+}
+
+int qparse(char *qs)
+{
+  char *cp;
+
+  memset(&q, 0, sizeof(q));
+  while (*qs != '\0') {
+    switch (*qs++) {
+      case '.':
+        q.type = S_IFREG;
+        break;
+      case '/':
+        q.type = S_IFDIR;
+        break;
+      case '@':
+        q.type = S_IFLNK;
+        break;
+      case '=':
+        q.type = S_IFSOCK;
+        break;
+      case 'p':
+        q.type = S_IFIFO;
+        break;
+      case '*':
+        q.type = S_IFREG;
+        q.exec = 1;
+        break;
+      case 'L':
+        q.lunit = 1;
+        if ((cp = strchr("kmg", *qs)) != NULL && *qs != '\0') {
+          q.lunit = 1LL << (10 * (cp - "kmg" + 1));
+          qs++;
+        }
+        if (!qnum(&qs, &q.lop, &q.lval))
+          return 0;
+        break;
+      case 'm':
+        q.munit = 86400;
+        if ((cp = strchr("wdhms", *qs)) != NULL && *qs != '\0') {
+          q.munit = (long long []){604800, 86400, 3600, 60, 1}[cp - "wdhms"];
+          qs++;
+        }
+        if (!qnum(&qs, &q.mop, &q.mval))
+          return 0;
+        break;
+      case 'o':
+      case 'O':
+        q.rev = qs[-1] == 'O';
+        if (*qs == '\0' || strchr("nLm", *qs) == NULL)
+          return 0;
+        q.key = *qs++;
+        break;
+      default:
+        return 0;
+    }
   }
-  return 0;  // Yet remain pattern char not matched
+  return 1;
 }
 
-int match(char* str, char *pat)
+int qcmp(int op, long long v, long long val)
 {
-  int match1(char *, char *);
+  if (op == '+')
+    return v > val;
+  if (op == '-')
+    return v < val;
+  return v == val;
+}
 
-  // Omit hidden files
-  if (*str == '.' && *pat != '.')
+int qkeep(struct ent *e, time_t now)
+{
+  if (e->st != 1)
+    return 0;
+  if (q.type && (e->mode & S_IFMT) != q.type)
+    return 0;
+  if (q.exec && !(e->mode & 0111))
     return 0;
-  return match1(str, pat);
+  if (q.lop && !qcmp(q.lop, (e->size + q.lunit - 1) / q.lunit, q.lval))
+    return 0;
+  if (q.mop && !qcmp(q.mop, (now - e->mtime) / q.munit, q.mval))
+    return 0;
+  return 1;
 }
 
-void expand(char *as)
+int qcompar(const void *p1, const void *p2)
+{
+  const struct ent *e1, *e2;
+  long long d;
+
+  e1 = p1;
+  e2 = p2;
+  d = 0;
+  if (q.key == 'L')
+    d = e1->size - e2->size;
+  else if (q.key == 'm')
+    d = e2->mtime - e1->mtime;
+  if (d == 0)
+    d = compar(&e1->name, &e2->name);
+  d = (d > 0) - (d < 0);
+  return q.rev ? -d : d;
+}
+
+// Rings of io_uring mapped from the kernel
+struct uring {
+  int fd;
+  unsigned nsq;
+  unsigned *sqtail;
+  unsigned *sqmask;
+  unsigned *sqarray;
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
+
+int usetup(struct uring *u)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+  long sqsz, cqsz;
+
+  memset(&p, 0, sizeof(p));
+  if ((u->fd = syscall(__NR_io_uring_setup, QDEPTH, &p)) < 0)
+    return 0;
+  sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqsz > sqsz)
+    sqsz = cqsz;
+  sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+      IORING_OFF_SQ_RING);
+  cq = sq;
+  if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap(NULL, cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+        IORING_OFF_CQ_RING);
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+    close(u->fd);
+    return 0;
+  }
+
+  u->nsq = p.sq_entries;
+  u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+  u->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sqarray = (unsigned *)(sq + p.sq_off.array);
+  u->cqhead = (unsigned *)(cq + p.cq_off.head);
+  u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+  u->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+void qfill(struct ent *e, struct statx *sx)
+{
+  e->st = 1;
+  e->mode = sx->stx_mode;
+  e->size = sx->stx_size;
+  e->mtime = sx->stx_mtime.tv_sec;
+}
+
+/* Fill in the entries by statx(2), submitted through io_uring a ring at a
+ * time, so that many paths take few system calls. What the ring could not
+ * do, or all where there is no io_uring, is done by statx one by one.
+ */
+void qstat(struct ent *e, int n)
+{
+  static struct statx sx[QDEPTH];
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct uring u;
+  unsigned tail, head;
+  int i, j, m, r, got, ring;
+
+  ring = usetup(&u);
+  for (i = 0; i < n; i += m) {
+    m = n - i < QDEPTH ? n - i : QDEPTH;
+    if (ring && m > u.nsq)
+      m = u.nsq;
+    if (ring) {
+      tail = *u.sqtail;
+      for (j = 0; j < m; j++) {
+        sqe = &u.sqes[tail & *u.sqmask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)e[i + j].name;
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->off = (unsigned long)&sx[j];
+        sqe->user_data = j;
+        u.sqarray[tail & *u.sqmask] = tail & *u.sqmask;
+        tail++;
+      }
+      __atomic_store_n(u.sqtail, tail, __ATOMIC_RELEASE);
+      r = syscall(__NR_io_uring_enter, u.fd, m, m, IORING_ENTER_GETEVENTS, NULL, 0);
+      // A ring left with entries not submitted is given up.
+      if (r < m) {
+        ring = 0;
+        if (r < 0)
+          r = 0;
+      }
+      for (got = 0; got < r; ) {
+        head = *u.cqhead;
+        if (head == __atomic_load_n(u.cqtail, __ATOMIC_ACQUIRE)) {
+          syscall(__NR_io_uring_enter, u.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+          continue;
+        }
+        cqe = &u.cqes[head & *u.cqmask];
+        j = cqe->user_data;
+        if (cqe->res == 0)
+          qfill(&e[i + j], &sx[j]);
+        else if (cqe->res != -EINVAL && cqe->res != -EOPNOTSUPP)
+          e[i + j].st = -1;
+        __atomic_store_n(u.cqhead, head + 1, __ATOMIC_RELEASE);
+        got++;
+      }
+      COUNT(SSTAT, 1);
+      if (!ring)
+        close(u.fd);
+    }
+    for (j = i; j < i + m; j++) {
+      if (e[j].st != 0)
+        continue;
+      COUNT(SSTAT, 1);
+      e[j].st = -1;
+      if (statx(AT_FDCWD, e[j].name, AT_SYMLINK_NOFOLLOW,
+            STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &sx[0]) == 0)
+        qfill(&e[j], &sx[0]);
+    }
+  }
+  if (ring)
+    close(u.fd);
+}
+
+/* Keep the paths expanded which the qualifiers let through, sorted as they
+ * tell or by name, and return how many are kept.
+ */
+int qualify(char **p, int n, char *qs)
+{
+  struct ent *e;
+  time_t now;
+  int i, k;
+
+  if (!qparse(qs)) {
+    write(STDOUT, "Bad qualifier\n", 14);
+    exit(-1);
+  }
+  if ((e = calloc(n + 1, sizeof(*e))) == NULL)
+    nomem();
+  for (i = 0; i < n; i++)
+    e[i].name = p[i];
+  if (q.type || q.lop || q.mop || q.key == 'L' || q.key == 'm')
+    qstat(e, n);
+  else
+    for (i = 0; i < n; i++)
+      e[i].st = 1;
+
+  now = time(NULL);
+  for (i = k = 0; i < n; i++)
+    if (qkeep(&e[i], now))
+      e[k++] = e[i];
+  qsort(e, k, sizeof(*e), qcompar);
+  for (i = 0; i < k; i++)
+    p[i] = e[i].name;
+  free(e);
+  return k;
+}
+
+/* Match the components in the directory open as fd, whose path is s with
+ * a trailing '/' or empty. A directory matched is opened relative to its
+ * parent with openat(), so a long prefix is never resolved again, and a
+ * component without glob characters is looked up instead of read.
+ */
+void walk(int fd, char *s, char **comp)
 {
-  char *s, *cs;
   DIR *dir;
-  char **oav;
   struct dirent *direp;
+  struct stat st;
+  int nfd;
+
+  if (!isglob(*comp)) {
+    if (comp[1] == NULL) {
+      if (**comp == '\0' || fstatat(fd, *comp, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        addarg(cat(s, *comp));
+        ncoll++;
+      }
+    } else if (**comp == '\0') {
+      walk(fd, cat(s, "/"), comp + 1);
+    } else if ((nfd = openat(fd, *comp, O_RDONLY | O_DIRECTORY)) >= 0) {
+      walk(nfd, cat(cat(s, *comp), "/"), comp + 1);
+      close(nfd);
+    }
+    return;
+  }
 
-  cs = as;
-  s = cs;
-  while (*cs != '*' && *cs != '?' && *cs != '[') {
-    if (*cs++ == '\0') {
-      *av++ = cat(s, "");
-      return;
+  if ((nfd = dup(fd)) < 0)
+    return;
+  if ((dir = fdopendir(nfd)) == NULL) {
+    close(nfd);
+    return;
+  }
+  while ((direp = readdir(dir)) != NULL) {
+    COUNT(SDENT, 1);
+    if (!match(direp->d_name, *comp))
+      continue;
+    if (comp[1] == NULL) {
+      addarg(cat(s, direp->d_name));
+      ncoll++;
+    } else if (direp->d_type == DT_DIR || direp->d_type == DT_LNK || direp->d_type == DT_UNKNOWN) {
+      nfd = openat(dirfd(dir), direp->d_name, O_RDONLY | O_DIRECTORY);
+      if (nfd >= 0) {
+        walk(nfd, cat(cat(s, direp->d_name), "/"), comp + 1);
+        close(nfd);
+      }
     }
   }
-  
-  for (;;) {
-    // There's no '/' character
-    if (cs == s) {
-      dir = opendir(".");
-      s = "";
-      break;
+  closedir(dir);
+}
+
+/* Glob characters may be in any component of the pattern. The literal
+ * components before the first one with glob characters are opened as one
+ * directory, the rest are walked, and all paths expanded from the pattern
+ * are sorted once at the end.
+ */
+void expand(char *as)
+{
+  char *s, *cs, *qs, **comp, **c;
+  int fd, n;
+  long oav;
+
+  // Qualifiers at the end in '(' ')' which is not escaped
+  qs = NULL;
+  n = strlen(as);
+  if (n > 0 && as[n - 1] == ')') {
+    for (cs = as; *cs != '\0'; cs++) {
+      if (*cs == '\\' && cs[1] != '\0')
+        cs++;
+      else if (*cs == '(')
+        qs = cs;
+    }
+    if (qs != NULL) {
+      as[n - 1] = '\0';
+      *qs++ = '\0';
     }
+  }
 
-    if (*--cs == '/') {
+  if (!isglob(as)) {
+    addarg(cat(unesc(as), ""));
+    return;
+  }
+  COUNT(SGLOB, 1);
+
+  n = 2;
+  for (cs = as; *cs != '\0'; cs++)
+    if (*cs == '/')
+      n++;
+  if ((comp = malloc(n * sizeof(char *))) == NULL)
+    nomem();
+
+  // Split the pattern into components at '/' which is not escaped.
+  n = 0;
+  comp[n++] = as;
+  for (cs = as; *cs != '\0'; cs++) {
+    if (*cs == '\\' && cs[1] != '\0')
+      cs++;
+    else if (*cs == '/') {
       *cs = '\0';
-      dir = opendir(s == cs ? "/" : s);
-      *cs++ = 0x80;  // Indicator
-      break;
+      comp[n++] = cs + 1;
     }
   }
+  comp[n] = NULL;
+  for (c = comp; *c != NULL; c++)
+    if (!isglob(*c))
+      unesc(*c);
+
+  c = comp;
+  s = "";
+  if (**c == '\0') {
+    s = "/";
+    c++;
+  }
+  while (!isglob(*c)) {
+    s = cat(cat(s, *c), "/");
+    c++;
+  }
 
-  if (dir < 0) {
+  fd = open(*s == '\0' ? "." : s, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
     write(STDOUT, "No directory\n", 13);
     exit(-1);
   }
 
-  oav = av;
-  while ((direp = readdir(dir)) != NULL) {
-    if (match(direp->d_name, cs)) {
-      *av++ = cat(s, direp->d_name);
-      ncoll++;
-    }
+  oav = av - ava;
+  walk(fd, s, c);
+  close(fd);
+  free(comp);
+  if (qs != NULL) {
+    n = av - ava - oav;
+    av = ava + oav + qualify(ava + oav, n, qs);
+    ncoll -= n - (av - ava - oav);
+  } else {
+    qsort(ava + oav, av - ava - oav, sizeof(char *), compar);
   }
-  closedir(dir);
-  sort(oav);
+
+  // Expanded range
+  if (fav == 0)
+    fav = oav;
+  lav = av - ava;
 }
 
 int main(int argc, char **argv)
 {
-  char *cp;
+  int fd;
 
-  string = ab;
+  if ((ava = malloc(ARGSIZ * sizeof(char *))) == NULL)
+    nomem();
   av = &ava[1];  // ava[0] is for "/bin/sh"
+  eav = ava + ARGSIZ;
+
+  // Options from the shell, -bN runs in batches N at a time,
+  // -sN counts in stats mapped from descriptor N, -p prints the arguments.
+  while (argc > 1 && argv[1][0] == '-' &&
+      (argv[1][1] == 'b' || argv[1][1] == 's' || argv[1][1] == 'p')) {
+    if (argv[1][1] == 'b') {
+      batch = atoi(argv[1] + 2);
+    } else if (argv[1][1] == 'p') {
+      print++;
+    } else {
+      fd = atoi(argv[1] + 2);
+      stats = mmap(NULL, NSTAT * sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (stats == MAP_FAILED)
+        stats = NULL;
+      close(fd);
+    }
+    argc--;
+    argv++;
+  }
 
   if (argc < 3) {
     write(STDOUT, "Arg count\n", 10);
@@ -237,7 +728,7 @@ int main(int argc, char **argv)
   }
 
   argv++;
-  *av++ = *argv;
+  addarg(unesc(*argv));
   while (--argc >= 2)
     expand(*++argv);
 
@@ -246,11 +737,17 @@ int main(int argc, char **argv)
     return 0;
   }
 
-  execute(ava[1], &ava[1]);
-  cp = cat("/usr/bin/", ava[1]);
-  execute(cp + 4, &ava[1]);
-  execute(cp, &ava[1]);
-  write(STDOUT, "Command not found\n", 19);
+  addarg(NULL);
+  av--;
+  // Each argument ends with '\0' for 'cache' to see what would run.
+  if (print) {
+    for (av = &ava[1]; *av != NULL; av++)
+      write(STDOUT, *av, strlen(*av) + 1);
+    return 0;
+  }
+  run(&ava[1]);
+  if (errno == E2BIG && batch > 0)
+    return runbatch();
   
   return 0;
 }
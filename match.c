@@ -0,0 +1,112 @@
+/***************************************************
+ *  File: match.c -- Glob patterns, shared by glob
+ *                   and the shell.
+ *
+ *          Author      Year    Description
+ *
+ *   1.  Ken Thompson   1975    Create on Unix V6
+ *   2.  Leo Ma         2013    Porting on Linux
+ *
+ ***************************************************/
+
+// Remove '\' put by the shell before quoted characters.
+char *unesc(char *as)
+{
+  char *s1, *s2;
+
+  s1 = s2 = as;
+  while ((*s2 = *s1++) != '\0') {
+    if (*s2 == '\\' && *s1 != '\0')
+      *s2 = *s1++;
+    s2++;
+  }
+  return as;
+}
+
+// Whether a pattern has a glob character which is not escaped
+int isglob(char *s)
+{
+  for (; *s != '\0'; s++) {
+    if (*s == '*' || *s == '?' || *s == '[')
+      return 1;
+    if (*s == '\\' && s[1] != '\0')
+      s++;
+  }
+  return 0;
+}
+
+int match1(char *str, char *pat)
+{
+  int s, p, rp, lp;
+  int ok;
+  int match2(char *, char *);
+
+  s = (unsigned char)*str++;
+
+  switch (p = (unsigned char)*pat++) {
+
+    case '[':
+      ok = 0;
+      lp = 0x100;
+      while ((rp = (unsigned char)*pat++) != '\0') {
+        if (rp == ']') {
+          if (ok)
+            return match1(str, pat);
+          else
+            return 0;
+        } else if (rp == '-') {
+          if (s >= lp && s <= (unsigned char)*pat++)
+            ok++;
+        } else {
+          if (rp == '\\' && *pat != '\0')
+            rp = (unsigned char)*pat++;
+          if (s == (lp = rp))
+            ok++;  // at least match one char will be ok
+        }
+      }
+      return 0;  // missing ']'
+
+    case '\\':
+      // Quoted character
+      if (*pat != '\0')
+        p = (unsigned char)*pat++;
+      // Note: Here's no break!
+    default:
+      if (s != p)  // not match
+        return 0;
+
+    case '?':
+      if (s != '\0')
+        return match1(str, pat);
+      return 0;  // Yet pattern not finished
+
+    case '*':
+      return match2(--str, pat);
+
+    case '\0':
+      return (s == '\0');  // both finished
+  }
+
+  return 0;
+}
+
+int match2(char* str, char *pat)
+{
+  if (*pat == '\0')  // '*' is the last char
+    return 1;
+  while (*str != '\0') {
+    if (match1(str++, pat))  // '*' match finished when pattern matched
+      return 1;
+  }
+  return 0;  // Yet remain pattern char not matched
+}
+
+int match(char* str, char *pat)
+{
+  int match1(char *, char *);
+
+  // Omit hidden files
+  if (*str == '.' && *pat != '.')
+    return 0;
+  return match1(str, pat);
+}
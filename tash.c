@@ -7,13 +7,37 @@
  *   2.  Leo Ma         2013    Porting on Linux
  *
  ***************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <termios.h>
+#include <setjmp.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <linux/mempolicy.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "builtin.h"
 
 //
 //#define SEEK_SET  0
@@ -33,11 +57,34 @@
 #define STDOUT  1
 #define STDERR  2
 
-#define LINSIZ  256
-#define TOKSIZ  50
-#define TRESIZ  100
+#define LINSIZ  1024
+#define TOKSIZ  256
+#define TRESIZ  512
 
-#define QUOTE  0x80 
+#define QUOTE  0x100
+
+// Token flag
+#define TKMET  1  // unquoted meta character
+#define TKQUO  2  // some characters are quoted
+#define TKGLB  4  // unquoted glob character
+#define TKSUB  8  // unquoted '$'
+
+/* Each token in the line buffer is preceded by its flag and length, and
+ * followed by a bitmap of its quoted characters if any is quoted.
+ */
+#define TFLAG(s)  (((unsigned char *)(s))[-3])
+#define TLEN(s)  (((unsigned char *)(s))[-2] | ((unsigned char *)(s))[-1] << 8)
+#define TQUOTED(s, i)  ((TFLAG(s) & TKQUO) && \
+    ((unsigned char *)(s))[TLEN(s) + 1 + ((i) >> 3)] & 1 << ((i) & 7))
+#define TOKC(s)  (TFLAG(s) & TKMET ? *(s) : 0)
+
+// Character class
+#define CBLK  1   // blank
+#define CMET  2   // meta character as a token by itself
+#define CQUO  4   // quote
+#define CGLB  8   // glob character
+#define CSPC  16  // escape, control or '$'
+#define CSEP  (CBLK | CMET | CQUO)
 
 // Attribute
 #define FAND  1
@@ -47,12 +94,17 @@
 #define FPAR  16
 #define FINT  32
 #define FPRS  64
+#define FTEE  128
 
 // Type
 #define TCOM  1 
 #define TPAR  2
 #define TFIL  3
 #define TLST  4
+#define TIF   5
+#define TWHL  6
+#define TFOR  7
+#define TTIM  8
 
 // Field
 #define DTYP  0
@@ -62,14 +114,64 @@
 #define DSPR  4
 #define DCOM  5
 
+// Counters of stats, shared with children and glob
+#define SFORK   0  // forks
+#define SEXEC   1  // exec probes
+#define SFAIL   2  // failed exec probes
+#define SGLOB   3  // glob patterns expanded
+#define SDENT   4  // directory entries scanned by glob
+#define SREAD   5  // reads of command input
+#define SWRITE  6  // writes of shell output
+#define SWAIT   7  // children waited for
+#define SWTIM   8  // time waiting for children in microseconds
+#define SSTAT   9  // system calls for glob qualifiers
+#define SRTRY   10 // forks tried again after EAGAIN or ENOMEM
+#define SJOBW   11 // background jobs which waited for a slot
+#define SJTIM   12 // time of those waits in microseconds
+#define NSTAT   13
+
+#define COUNT(i, n)  __atomic_fetch_add(&stats[i], n, __ATOMIC_RELAXED)
+
+// Entry of the cache, the header followed by stdout and stderr
+#define CMAGIC  0x3163616368736174  // "tashcac1"
+struct chead {
+  long magic;
+  long status;
+  long nout;
+  long nerr;
+};
+
 // '$' indicator
-char *dolp;
 char **dolv;
 int dolc;
 
-char pidp[4];
+char pidp[8];
+
+// Exit status of the last command
+int exitval;
+
+// Shell variables
+struct var {
+  char *name;
+  char *value;
+  struct var *next;
+} *vars;
+
+// Token being built
+char *tokbeg;
+int tokflg;
+unsigned char tokq[LINSIZ / 8];
+
+// Buffer for '$' substitution
+char subbuf[LINSIZ];
+char *subp;
+unsigned long comt[TOKSIZ + DCOM];
 
 char *prompt;
+int hist;
+
+// Character class table of lexer
+unsigned char ctab[256];
 
 // Line buffer
 char line[LINSIZ];
@@ -86,10 +188,9 @@ unsigned long trebuf[TRESIZ];
 unsigned long *treep;
 unsigned long *treeend;
 
-char peekc;
+int peekc;
 
 char overflow;
-char glob;
 char error;
 char uid;
 char setintr;
@@ -97,6 +198,89 @@ char setintr;
 char *arginp;
 int onelflg;
 
+// Script being read by the '.' command
+char *srcp;
+char *srcend;
+int srcdepth;
+
+// Commands of scripts parsed by the '.' command
+struct script {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  unsigned long **cmds;
+  int ncmd;
+  struct script *next;
+} *scripts;
+
+// Sessions of a script file parsed ahead while a command runs, each with
+// the offset after it and the memory of its tree
+#define AQMAX  64
+unsigned long *aq[AQMAX];
+unsigned long *aqmem[AQMAX];
+long aqoff[AQMAX];
+int aqh;
+int aqn;
+int aqon;
+jmp_buf aqjmp;
+int aqquiet;  // errors parsing ahead are left to be found again in turn
+long aqend;   // offset after the text parsed ahead
+long aqpos;   // offset the shell has read to
+long aqfpos;  // offset the shell left the file at
+int aqpend;   // aqpos is not yet given to the file
+
+// Built-in command of the table, run in the shell or in a child
+struct builtin {
+  char *name;
+  void (*func)(unsigned long *t);
+};
+
+// Built-in stages of pipelines running on threads
+struct bstage {
+  pthread_t tid;
+  int (*func)(int, int, char **);
+  int in;
+  int out;
+  int status;
+  char **argv;
+  struct bstage *next;
+} *bstages;
+pthread_mutex_t bslock = PTHREAD_MUTEX_INITIALIZER;
+
+// Last command of the input, run without fork
+unsigned long *tailt;
+
+// Deadline of 'timeout' and the processes of its pipeline
+struct timespec deadline;
+int tpid[TOKSIZ];
+int ntpid;
+int tpgid;  // process group of them all, the first one's
+
+// Children in background for 'wait'
+int bgpid[TOKSIZ];
+int nbg;
+
+// Jobs in background for 'set maxjobs', by the last command of each
+int jobpid[TOKSIZ];
+int njob;
+
+// Pipeline stage for CPU placement
+int stage;
+int ncpu;
+int *cpuord;
+cpu_set_t cpuset;
+
+// Counters in memory shared by all processes of the shell
+long *stats;
+int statfd = -1;
+char *statname[] = {
+  "forks", "execs", "failed_execs", "globs", "dirents",
+  "reads", "writes", "waits", "wait_us", "qual_stats",
+  "fork_retries", "job_waits", "job_wait_us",
+};
+
 
 char *mesg[] = {
   0,
@@ -130,6 +314,7 @@ struct stime {
 
 void put(char c)
 {
+  COUNT(SWRITE, 1);
   write(STDOUT, &c, 1);
 }
 
@@ -176,6 +361,26 @@ void err(char *s)
   }
 }
 
+long setnum(char *name);
+
+// Glob patterns of match.c
+char *unesc(char *as);
+int isglob(char *s);
+int match(char *str, char *pat);
+
+// Tracing output on STDERR with 'set trace 1'
+void trace(char *fmt, ...)
+{
+  va_list ap;
+
+  if (setnum("trace") <= 0)
+    return;
+  va_start(ap, fmt);
+  write(STDERR, "+ ", 2);
+  vdprintf(STDERR, fmt, ap);
+  va_end(ap);
+}
+
 int any(int c, char *s)
 {
   while (*s) {
@@ -185,6 +390,111 @@ int any(int c, char *s)
   return 0;
 }
 
+void ctinit()
+{
+  char *s;
+  int c;
+
+  for (c = 0; c <= ' '; c++)
+    ctab[c] = CSPC;
+  ctab['\\'] = CSPC;
+  ctab['$'] = CSPC;
+  for (s = " \t"; *s != '\0'; s++)
+    ctab[(int)*s] |= CBLK;
+  for (s = ";&<>()|^\n"; *s != '\0'; s++)
+    ctab[(int)*s] |= CMET;
+  for (s = "'\""; *s != '\0'; s++)
+    ctab[(int)*s] |= CQUO;
+  for (s = "[?*"; *s != '\0'; s++)
+    ctab[(int)*s] |= CGLB;
+}
+
+/* Length of the leading run of ordinary characters which need no more than
+ * a copy by the lexer and leave the token flag alone, at most n. Since the run ends at '\0' at the latest,
+ * aligned vector loads never cross the page of the string end.
+ */
+int ordlen(char *s, int n)
+{
+  char *p;
+#if defined(__AVX2__) || defined(__SSE2__)
+  unsigned int m;
+  int k;
+#endif
+
+#if defined(__AVX2__)
+  __m256i v, x;
+
+  k = (unsigned long)s & 31;
+  p = s - k;
+  for (;;) {
+    v = _mm256_load_si256((__m256i *)p);
+    // Control and blank characters are those unchanged by max(c, ' ').
+    x = _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(' ')), _mm256_set1_epi8(' '));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('$')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('^')));
+    x = _mm256_or_si256(x, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+    m = (unsigned int)_mm256_movemask_epi8(x) >> k << k;
+    if (m != 0 || p - s + 32 >= n)
+      break;
+    p += 32;
+    k = 0;
+  }
+  if (m != 0 && p - s + __builtin_ctz(m) < n)
+    return p - s + __builtin_ctz(m);
+  return n;
+#elif defined(__SSE2__)
+  __m128i v, x;
+
+  k = (unsigned long)s & 15;
+  p = s - k;
+  for (;;) {
+    v = _mm_load_si128((__m128i *)p);
+    // Control and blank characters are those unchanged by max(c, ' ').
+    x = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(' ')), _mm_set1_epi8(' '));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('^')));
+    x = _mm_or_si128(x, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+    m = (unsigned int)_mm_movemask_epi8(x) >> k << k;
+    if (m != 0 || p - s + 16 >= n)
+      break;
+    p += 16;
+    k = 0;
+  }
+  if (m != 0 && p - s + __builtin_ctz(m) < n)
+    return p - s + __builtin_ctz(m);
+  return n;
+#else
+  for (p = s; p < s + n; p++)
+    if (ctab[(unsigned char)*p] & (CSEP | CSPC | CGLB))
+      break;
+  return p - s;
+#endif
+}
+
 int equal(char *s1, char *s2)
 {
   while (*s1 == *s2++) {
@@ -194,27 +504,218 @@ int equal(char *s1, char *s2)
   return 0;
 }
 
-void scan(unsigned long *at, char (*f)(char))
+char *tbegin(char *p)
 {
-  char *p, c;
-  unsigned long *t;
+  tokflg = 0;
+  memset(tokq, 0, sizeof(tokq));
+  tokbeg = p + 3;  // Room for flag and length
+  return tokbeg;
+}
+
+// Store one character of the token and mark it in the flag and the bitmap.
+char *tput(char *p, int c)
+{
+  int n;
 
-  t = at + DCOM;
-  while ((p = (char *)*t++) != '\0')
-    while ((c = *p) != '\0')
-      *p++ = (*f)(c);
+  if (c & QUOTE) {
+    n = p - tokbeg;
+    tokq[n >> 3] |= 1 << (n & 7);
+    tokflg |= TKQUO;
+  } else if (ctab[c] & CGLB) {
+    tokflg |= TKGLB;
+  } else if (c == '$') {
+    tokflg |= TKSUB;
+  }
+  *p++ = c;
+  return p;
 }
 
-char tglob(char c)
+char *tend(char *p)
 {
-  if (any(c, "[?*"))
-    glob = 1;
-  return c;
+  int n;
+
+  n = p - tokbeg;
+  *p++ = '\0';
+  tokbeg[-3] = tokflg;
+  tokbeg[-2] = n & 0xff;
+  tokbeg[-1] = n >> 8;
+  if (tokflg & TKQUO) {
+    memcpy(p, tokq, (n + 7) >> 3);
+    p += (n + 7) >> 3;
+  }
+  return p;
+}
+
+int isname(int c)
+{
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+char *getvar(char *name)
+{
+  struct var *v;
+
+  for (v = vars; v != NULL; v = v->next)
+    if (equal(v->name, name))
+      return v->value;
+  return getenv(name);
+}
+
+void setvar(char *name, char *value)
+{
+  struct var *v;
+
+  for (v = vars; v != NULL; v = v->next)
+    if (equal(v->name, name))
+      break;
+
+  if (v == NULL) {
+    v = malloc(sizeof(*v));
+    if (v == NULL || (v->name = strdup(name)) == NULL) {
+      err("Out of memory");
+      return;
+    }
+    v->value = NULL;
+    v->next = vars;
+    vars = v;
+  }
+
+  free(v->value);
+  if ((v->value = strdup(value)) == NULL) {
+    v->value = "";
+    err("Out of memory");
+  }
+}
+
+/* Numeric value of a shell variable used as setting, with an optional
+ * suffix k, m or g. Unset or empty setting is 0.
+ */
+long setnum(char *name)
+{
+  struct var *v;
+  char *cp;
+  long n;
+
+  for (v = vars; v != NULL; v = v->next)
+    if (equal(v->name, name))
+      break;
+  if (v == NULL)
+    return 0;
+
+  n = strtol(v->value, &cp, 0);
+  switch (*cp) {
+    case 'g':
+    case 'G':
+      n <<= 10;
+    case 'm':
+    case 'M':
+      n <<= 10;
+    case 'k':
+    case 'K':
+      n <<= 10;
+  }
+  return n;
+}
+
+/* Substitute '$n', '$$', '$?' and '$name' of one argument at execution time
+ * so that a parsed tree can be run again with different values.
+ */
+char *dosub(char *s)
+{
+  char *cp, *ecp, *v, name[32], num[12];
+  int c, i, n, q, len;
+
+  cp = tbegin(subp);
+  ecp = subbuf + LINSIZ - LINSIZ / 8 - 1;
+  len = TLEN(s);
+  for (i = 0; i < len; ) {
+    c = (unsigned char)s[i];
+    if (c != '$' || TQUOTED(s, i)) {
+      if (cp < ecp)
+        cp = tput(cp, TQUOTED(s, i) ? c | QUOTE : c);
+      i++;
+      continue;
+    }
+
+    // Within double quotes, '$' is left unquoted but what follows it is not,
+    // and so is the value.
+    c = ++i < len ? s[i] : '\0';
+    q = i < len && TQUOTED(s, i) ? QUOTE : 0;
+    if (c >= '0' && c <= '9') {
+      i++;
+      v = c - '0' < dolc ? dolv[c - '0'] : "";
+    } else if (c == '$') {
+      i++;
+      v = pidp;
+    } else if (c == '?') {
+      i++;
+      v = num + sizeof(num) - 1;
+      *v = '\0';
+      n = exitval;
+      do {
+        *--v = n % 10 + '0';
+        n /= 10;
+      } while (n > 0);
+    } else if (isname(c)) {
+      // Name might be quoted within double quotes, and ends with them.
+      n = 0;
+      while (i < len && (isname(c = s[i]) || (c >= '0' && c <= '9')) &&
+             (TQUOTED(s, i) ? QUOTE : 0) == q) {
+        if (n < sizeof(name) - 1)
+          name[n++] = c;
+        i++;
+      }
+      name[n] = '\0';
+      if ((v = getvar(name)) == NULL)
+        v = "";
+    } else {
+      v = "$";
+    }
+
+    while (*v != '\0' && cp < ecp)
+      cp = tput(cp, (unsigned char)*v++ | q);
+  }
+
+  v = tokbeg;
+  subp = tend(cp);
+  return v;
+}
+
+// A single word such as the file of a redirection, substituted if it has to.
+char *wsub(unsigned long w)
+{
+  char *s;
+
+  s = (char *)w;
+  return s != NULL && (TFLAG(s) & TKSUB) ? dosub(s) : s;
 }
 
-char trim(char c)
+/* Copy simple command with substituted arguments and redirections, the
+ * original tree is left untouched for the next run. Files fanned out are
+ * substituted by fanout().
+ */
+unsigned long *subst(unsigned long *t)
 {
-  return (c & 0x7f);
+  unsigned long *p, *t1;
+
+  subp = subbuf;
+  for (p = t + DCOM; *p != 0; p++)
+    if (TFLAG(*p) & TKSUB)
+      break;
+  if (*p == 0 && (t[DLEF] == 0 || !(TFLAG(t[DLEF]) & TKSUB)) &&
+      (t[DRIT] == 0 || (t[DFLG] & FTEE) || !(TFLAG(t[DRIT]) & TKSUB)))
+    return t;
+
+  t1 = comt;
+  for (p = t; p < t + DCOM; p++)
+    *t1++ = *p;
+  for (; *p != 0; p++)
+    *t1++ = TFLAG(*p) & TKSUB ? (unsigned long)dosub((char *)*p) : *p;
+  *t1 = 0;
+  comt[DLEF] = (unsigned long)wsub(t[DLEF]);
+  if (!(t[DFLG] & FTEE))
+    comt[DRIT] = (unsigned long)wsub(t[DRIT]);
+  return comt;
 }
 
 unsigned long *tree(int n)
@@ -224,6 +725,8 @@ unsigned long *tree(int n)
   t = treep;
   treep += n;
   if (treep > treeend) {
+    if (aqquiet)
+      longjmp(aqjmp, 1);
     prs("Command line overflow\n");
     error++;
     //reset();
@@ -232,14 +735,181 @@ unsigned long *tree(int n)
   return t;
 }
 
+unsigned long *parse(char **p1, char **p2);
 unsigned long *parse1(char **p1, char **p2);
 unsigned long *parse2(char **p1, char **p2);
+unsigned long *parset(char **p1, char **p2);
 unsigned long *parse3(char **p1, char **p2);
 
+// Keyword is never quoted.
+int kw(char *s, char *k)
+{
+  return !(TFLAG(s) & TKQUO) && equal(s, k);
+}
+
+/* Control keywords are recognized only at the beginning of a command,
+ * that is after a separator or after a keyword which starts a list.
+ */
+int cmdpos(char **p, char **p1)
+{
+  char *s;
+
+  if (p == p1)
+    return 1;
+  s = *(p - 1);
+  if (any(TOKC(s), ";&|^(\n"))
+    return 1;
+  if (kw(s, "if") || kw(s, "then") || kw(s, "else") ||
+      kw(s, "elif") || kw(s, "while") || kw(s, "do"))
+    return cmdpos(p - 1, p1);
+  // After 'timeout duration'
+  if (p - p1 >= 2 && !TOKC(s) && kw(*(p - 2), "timeout") && cmdpos(p - 2, p1))
+    return 1;
+  return 0;
+}
+
+// Return 1 for an opening keyword, -1 for a closing one and 0 otherwise.
+int nest(char **p, char **p1)
+{
+  if (kw(*p, "if") || kw(*p, "while") || kw(*p, "for")) {
+    if (cmdpos(p, p1))
+      return 1;
+  } else if (kw(*p, "fi") || kw(*p, "done")) {
+    if (cmdpos(p, p1))
+      return -1;
+  }
+  return 0;
+}
+
+// Find the next keyword which ends a part of the control command.
+char **ctlend(char **p1, char **p2)
+{
+  char **p;
+  int l;
+
+  l = 0;
+  for (p = p1; p != p2; p++) {
+    if (TOKC(*p) == '(') {
+      l++;
+    } else if (TOKC(*p) == ')') {
+      l--;
+    } else if (l == 0 && cmdpos(p, p1) &&
+        (kw(*p, "then") || kw(*p, "else") || kw(*p, "elif") ||
+         kw(*p, "do") || kw(*p, "fi") || kw(*p, "done"))) {
+      return p;
+    } else {
+      l += nest(p, p1);
+    }
+  }
+  error++;
+  return p2;
+}
+
+/* Parse control command once into the syntax tree:
+ *   if list then list [elif list then list] [else list] fi
+ *   while list do list done
+ *   for name in word ... do list done
+ * and return the position just after its closing keyword.
+ */
+unsigned long *parsectl(char ***pp, char **p2)
+{
+  char **p, **q, **r;
+  unsigned long *t;
+  int n;
+
+  p = *pp;
+  if (kw(*p, "if") || kw(*p, "elif")) {
+    t = tree(DCOM + 2);
+    t[DTYP] = TIF;
+    q = ctlend(p + 1, p2);
+    if (q == p2 || !kw(*q, "then"))
+      goto ERR;
+    t[DSPR] = (unsigned long)parse(p + 1, q);
+    r = ctlend(q + 1, p2);
+    if (r == p2)
+      goto ERR;
+    t[DCOM] = (unsigned long)parse(q + 1, r);
+    t[DCOM + 1] = 0;
+    if (kw(*r, "elif")) {
+      // 'elif' shares the closing 'fi' with the outer command.
+      *pp = r;
+      t[DCOM + 1] = (unsigned long)parsectl(pp, p2);
+      r = *pp - 1;
+    } else {
+      if (kw(*r, "else")) {
+        q = r;
+        r = ctlend(q + 1, p2);
+        if (r == p2)
+          goto ERR;
+        t[DCOM + 1] = (unsigned long)parse(q + 1, r);
+      }
+      if (!kw(*r, "fi"))
+        goto ERR;
+    }
+  } else if (kw(*p, "while")) {
+    t = tree(DCOM + 1);
+    t[DTYP] = TWHL;
+    q = ctlend(p + 1, p2);
+    if (q == p2 || !kw(*q, "do"))
+      goto ERR;
+    t[DSPR] = (unsigned long)parse(p + 1, q);
+    r = ctlend(q + 1, p2);
+    if (r == p2 || !kw(*r, "done"))
+      goto ERR;
+    t[DCOM] = (unsigned long)parse(q + 1, r);
+  } else {
+    // for name in word ... ; do list done
+    if (p2 - p < 3 || TOKC(*(p + 1)) || !kw(*(p + 2), "in"))
+      goto ERR;
+    for (q = p + 3; q != p2 && !TOKC(*q); q++)
+      continue;
+    if (q == p2 || (TOKC(*q) != ';' && TOKC(*q) != '\n'))
+      goto ERR;
+    n = q - (p + 3);
+    t = tree(DCOM + n + 2);
+    t[DTYP] = TFOR;
+    t[DSPR] = (unsigned long)*(p + 1);
+    for (n = 0; p + 3 + n != q; n++)
+      t[DCOM + 1 + n] = (unsigned long)*(p + 3 + n);
+    t[DCOM + 1 + n] = 0;
+    while (q != p2 && (TOKC(*q) == ';' || TOKC(*q) == '\n'))
+      q++;
+    if (q == p2 || !kw(*q, "do"))
+      goto ERR;
+    r = ctlend(q + 1, p2);
+    if (r == p2 || !kw(*r, "done"))
+      goto ERR;
+    t[DCOM] = (unsigned long)parse(q + 1, r);
+  }
+
+  // parse3() gives redirections and flags to the outer command only, and
+  // the tree space is reused, so an 'elif' would find old words there.
+  t[DLEF] = 0;
+  t[DRIT] = 0;
+  t[DFLG] = 0;
+  if (t[DSPR] == 0 || t[DCOM] == 0)
+    error++;
+  *pp = r + 1;
+  return t;
+
+ERR:
+  error++;
+  *pp = p2;
+  t = tree(DCOM + 2);
+  t[DTYP] = TIF;
+  t[DLEF] = 0;
+  t[DRIT] = 0;
+  t[DFLG] = 0;
+  t[DSPR] = 0;
+  t[DCOM] = 0;
+  t[DCOM + 1] = 0;
+  return t;
+}
+
 unsigned long *parse(char **p1, char **p2)
 {
   while (p1 != p2) {
-    if (any(**p1, ";&\n")) {
+    if (any(TOKC(*p1), ";&\n")) {
       p1++;
     } else {
       return parse1(p1, p2);
@@ -259,7 +929,7 @@ unsigned long *parse1(char **p1, char **p2)
 
   l = 0;
   for (p = p1; p != p2; p++) {
-    switch (**p) {
+    switch (TOKC(*p)) {
       case '(':
         l++;
         continue;
@@ -272,32 +942,54 @@ unsigned long *parse1(char **p1, char **p2)
       case '\n':
         // Parathesis should be passed down to the next stage.
         if (l == 0) {
-          c = **p;
+          c = TOKC(*p);
           t = tree(4);
           t[DTYP] = TLST;
-          t[DLEF] = (unsigned long)parse2(p1, p);
+          t[DLEF] = (unsigned long)parset(p1, p);
           t[DFLG] = 0;
           // Push down the attribute immediately.
           if (c == '&') {
             t1 = (unsigned long *)t[DLEF];
-            t1[DFLG] = FAND | FPRS | FINT;
+            t1[DFLG] |= FAND | FPRS | FINT;
           }
           t[DRIT] = (unsigned long)parse(p + 1, p2);
+          return t;
         }
-        return t;
+        continue;
+
+      default:
+        if ((l += nest(p, p1)) < 0)
+          error++;
     }
   }
 
   // Not found, transfer into the next stage.
   // Note: we should check whether parathesis is complete or not. 
   if (l == 0) {
-    return parse2(p1, p2);
+    return parset(p1, p2);
   } else {
     error++;
     return NULL;
   }
 }
 
+// 'timeout duration' in front of a pipeline applies to all of it.
+unsigned long *parset(char **p1, char **p2)
+{
+  unsigned long *t;
+
+  if (p2 - p1 < 3 || !kw(*p1, "timeout") || TOKC(*(p1 + 1)))
+    return parse2(p1, p2);
+  t = tree(DCOM + 1);
+  t[DTYP] = TTIM;
+  t[DLEF] = 0;
+  t[DRIT] = 0;
+  t[DFLG] = 0;
+  t[DSPR] = (unsigned long)*(p1 + 1);
+  t[DCOM] = (unsigned long)parse2(p1 + 2, p2);
+  return t;
+}
+
 /* Stage 2 parses filter whose left tree to be transferred to stage 3
  * and right tree to be recursed. 
  */
@@ -309,7 +1001,7 @@ unsigned long *parse2(char **p1, char **p2)
 
   l = 0;
   for (p = p1; p != p2; p++) {
-    switch (**p) {
+    switch (TOKC(*p)) {
       case '(':
         l++;
         continue;
@@ -328,6 +1020,10 @@ unsigned long *parse2(char **p1, char **p2)
           t[DFLG] = 0;  // Note: Attribute to be pushed down in execute() function.
           return t;
         }
+        continue;
+
+      default:
+        l += nest(p, p1);
     }
   }
 
@@ -344,13 +1040,14 @@ unsigned long *parse3(char **p1, char **p2)
 {
   char **p, c;
   char **lp, **rp;
-  unsigned long *t;
-  int n, l;
-  unsigned long input, output, flag;
+  char *outv[TOKSIZ / 2];
+  unsigned long *t, *ct;
+  int n, l, nout;
+  unsigned long input, output, flag, cat, outf[TOKSIZ / 2];
 
   flag = 0;
   // Last sub command in parathesis commands.
-  if (**p2 == ')') {
+  if (TOKC(*p2) == ')') {
     flag |= FPAR;
   }
 
@@ -358,15 +1055,23 @@ unsigned long *parse3(char **p1, char **p2)
   rp = NULL;
   input = 0;
   output = 0;
+  nout = 0;
+  cat = 0;
   n = 0;
   l = 0;
 
-  for (p = p1; p != p2; p++) {
-    switch (c = **p) {
+  // Control command, only redirection may follow it.
+  ct = NULL;
+  p = p1;
+  if (nest(p1, p1) > 0)
+    ct = parsectl(&p, p2);
+
+  for (; p != p2; p++) {
+    switch (c = TOKC(*p)) {
 
       case '(':
         if (l == 0) {
-          if (lp != NULL)
+          if (lp != NULL || ct != NULL)
             error++;
           lp = p + 1;
         }
@@ -380,9 +1085,10 @@ unsigned long *parse3(char **p1, char **p2)
 
       case '>':
         p++;
-        if (p != p2 && **p == '>') {
-          flag |= FCAT;
+        if (p != p2 && TOKC(*p) == '>') {
+          cat = FCAT;
         } else {
+          cat = 0;
           p--;
         }
         // Note: Here's no break!
@@ -395,7 +1101,7 @@ unsigned long *parse3(char **p1, char **p2)
             p--;
           }
           // Illegal character
-          if (any(**p, "<>(")) {
+          if (any(TOKC(*p), "<>(")) {
             error++;
           }
           // Input&output redirection
@@ -404,10 +1110,12 @@ unsigned long *parse3(char **p1, char **p2)
               error++;
             input = (unsigned long)*p;
           } else {
-            if (output != 0) {
+            if (nout == TOKSIZ / 2)
               error++;
+            else {
+              outv[nout] = *p;
+              outf[nout++] = cat;
             }
-            output = (unsigned long)*p;
           }
         }
         continue;
@@ -415,11 +1123,33 @@ unsigned long *parse3(char **p1, char **p2)
       default:
         // Simple command, store command arguments
         if (l == 0) {
+          if (ct != NULL)
+            error++;
           p1[n++] = *p;
         }
     }
   }
 
+  // More than one output is fanned out by the child, see fanout().
+  if (nout == 1) {
+    output = (unsigned long)outv[0];
+    flag |= outf[0];
+  } else if (nout > 1) {
+    t = tree(2 * nout + 1);
+    for (l = 0; l < nout; l++) {
+      t[2 * l] = (unsigned long)outv[l];
+      t[2 * l + 1] = outf[l];
+    }
+    t[2 * l] = 0;
+    output = (unsigned long)t;
+    flag |= FTEE;
+  }
+
+  if (ct != NULL) {
+    t = ct;
+    goto OUT;
+  }
+
   // Parathesis command
   if (lp != 0) {
     if (n != 0)
@@ -450,13 +1180,17 @@ void texec(char *path, unsigned long *t)
 {
   extern int errno;
 
+  COUNT(SEXEC, 1);
   execv(path, (char **)(t + DCOM));
+  COUNT(SFAIL, 1);
 
   if (errno == ENOEXEC) {
     if (*linep != '\0')
       t[DCOM] = (unsigned long)linep;
     t[DSPR] = (unsigned long)"/bin/sh";
+    COUNT(SEXEC, 1);
     execv((char *)t[DSPR], (char **)(t + DSPR));
+    COUNT(SFAIL, 1);
     prs("No shell!\n");
     exit(-1);
   }
@@ -468,18 +1202,171 @@ void texec(char *path, unsigned long *t)
   }
 }
 
+// Duration like 1.5, 10s, 2m or 1h from now, return 0 if bad.
+int deadl(char *s, struct timespec *dl)
+{
+  double d;
+  char *e;
+
+  d = strtod(s, &e);
+  if (e == s || d < 0)
+    return 0;
+  switch (*e) {
+    case 'h':
+      d *= 60;
+    case 'm':
+      d *= 60;
+    case 's':
+      e++;
+  }
+  if (*e != '\0')
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, dl);
+  dl->tv_sec += (long)d;
+  dl->tv_nsec += (d - (long)d) * 1000000000;
+  if (dl->tv_nsec >= 1000000000) {
+    dl->tv_sec++;
+    dl->tv_nsec -= 1000000000;
+  }
+  return 1;
+}
+
+int pidopen(int pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+/* Wait until the child can be reaped or the deadline passes, return 0 at
+ * the deadline. The child is polled through its pidfd, or every 10ms on
+ * kernels without pidfd_open(2), and is left to be reaped.
+ */
+int pidwait(int pid, struct timespec *dl)
+{
+  struct timespec now, ts;
+  struct pollfd pfd;
+  siginfo_t si;
+  long ms;
+  int n;
+
+  pfd.fd = pidopen(pid);
+  pfd.events = POLLIN;
+  for (;;) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (dl->tv_sec - now.tv_sec) * 1000 + (dl->tv_nsec - now.tv_nsec) / 1000000;
+    if (ms < 0)
+      ms = 0;
+    if (pfd.fd >= 0) {
+      if ((n = poll(&pfd, 1, ms)) < 0 && errno == EINTR)
+        continue;
+      close(pfd.fd);
+      return n != 0;
+    }
+    si.si_pid = 0;
+    if (waitid(P_PID, pid, &si, WEXITED | WNOHANG | WNOWAIT) < 0 || si.si_pid != 0)
+      return 1;
+    if (ms == 0)
+      return 0;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 10000000;
+    nanosleep(&ts, NULL);
+  }
+}
+
+/* Processes under 'timeout' are put in a process group of their own, so
+ * that those they start are signalled too. On a terminal the group is
+ * given the foreground while it runs, so that ^C still reaches it.
+ */
+void tgroup(int pid, unsigned long flag)
+{
+  void (*f)(int);
+
+  setpgid(pid, tpgid ? tpgid : pid);
+  if (tpgid != 0)
+    return;
+  tpgid = pid;
+  if (!(flag & (FAND | FINT)) && isatty(STDIN) && tcgetpgrp(STDIN) == getpgrp()) {
+    f = signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN, pid);
+    signal(SIGTTOU, f);
+  }
+}
+
+// The terminal is taken back from the group when the pipeline is done.
+void tungroup()
+{
+  void (*f)(int);
+
+  if (tpgid != 0 && isatty(STDIN) && tcgetpgrp(STDIN) == tpgid) {
+    f = signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN, getpgrp());
+    signal(SIGTTOU, f);
+  }
+  tpgid = 0;
+}
+
+/* At the deadline of 'timeout' the process group of its pipeline gets
+ * SIGTERM, and 'set killafter' seconds later, 1 by default, SIGKILL if
+ * any of the pipeline is left, and anything else left in the group too.
+ * They are reaped here without a message.
+ */
+void tkill()
+{
+  struct timespec dl;
+  int i, status;
+
+  trace("timeout: %d processes killed\n", ntpid);
+  if (tpgid > 0)
+    kill(-tpgid, SIGTERM);
+  for (i = 0; i < ntpid; i++)
+    kill(tpid[i], SIGTERM);
+  clock_gettime(CLOCK_MONOTONIC, &dl);
+  dl.tv_sec += setnum("killafter") > 0 ? setnum("killafter") : 1;
+  for (i = 0; i < ntpid; i++) {
+    if (!pidwait(tpid[i], &dl))
+      kill(tpid[i], SIGKILL);
+    waitpid(tpid[i], &status, 0);
+  }
+  if (tpgid > 0)
+    kill(-tpgid, SIGKILL);
+  tungroup();
+  ntpid = 0;
+  exitval = 124;
+}
+
+void ahead();
+
 void pwait(int p, unsigned long *t)
 {
+  char *cp;
   int pid, error, status;
+  struct timespec ts0, ts1;
 
   if (p == 0)
     return;
 
+  if (p > 0 && deadline.tv_sec != 0 && !pidwait(p, &deadline)) {
+    tkill();
+    return;
+  }
+
+  if (p > 0 && aqon && ((cp = getvar("readahead")) == NULL ? aqon == 1 : !equal(cp, "0")))
+    ahead();
+
   for (;;) {
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
     pid = wait(&status);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    COUNT(SWTIM, (ts1.tv_sec - ts0.tv_sec) * 1000000 + (ts1.tv_nsec - ts0.tv_nsec) / 1000);
     if (pid == -1)
       break;
+    COUNT(SWAIT, 1);
     error = status & 0x7f;
+    if (pid == p)
+      exitval = error ? error | 0x80 : (status >> 8) & 0xff;
     if (mesg[error]) {
       if (pid != p) {
         prn(pid);
@@ -498,80 +1385,2761 @@ void pwait(int p, unsigned long *t)
   }
 }
 
-void execute(unsigned long *t, int *pf1, int *pf2)
+/* fork(2) failing for lack of processes or memory is tried again up to
+ * 'set forkretry' times, 6 by default, after 'set forkdelay' milliseconds,
+ * 10 by default, doubled each time up to a second.
+ */
+int tfork()
 {
-  unsigned long flag;
-  unsigned long *t1;
-  char *cp1, *cp2;
-  int pid, fd, pv[2];
-  extern int errno;
+  struct timespec ts;
+  long n, ms;
+  int pid;
 
-  if (t == NULL)
-    return;
+  n = getvar("forkretry") == NULL ? 6 : setnum("forkretry");
+  ms = getvar("forkdelay") == NULL ? 10 : setnum("forkdelay");
+  for (;;) {
+    // No child may keep descriptors a built-in stage is closing.
+    pthread_mutex_lock(&bslock);
+    pid = fork();
+    pthread_mutex_unlock(&bslock);
+    if (pid != -1 || (errno != EAGAIN && errno != ENOMEM) || n-- <= 0)
+      break;
+    COUNT(SRTRY, 1);
+    trace("fork: %s, again in %ldms\n", strerror(errno), ms);
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = ms % 1000 * 1000000;
+    nanosleep(&ts, NULL);
+    if ((ms *= 2) > 1000)
+      ms = 1000;
+  }
+  if (pid > 0)
+    COUNT(SFORK, 1);
+  return pid;
+}
 
-  switch (t[DTYP]) {
+// Tell how a child in background ended, if by a signal.
+void jmesg(int pid, int status)
+{
+  if (mesg[status & 0x7f]) {
+    prn(pid);
+    prs(": ");
+    prs(mesg[status & 0x7f]);
+    if (status & 0x80)
+      prs(" -- Core dumped\n");
+  }
+}
 
-    case TCOM:
-      cp1 = (char *)t[DCOM];
-      /* Buid-in command */
-      if (equal(cp1, "chdir")) {
-        if (t[DCOM + 1]) {
-          if (chdir((char *)t[DCOM + 1]) < 0)
-            err("chdir: bad directory");
-        } else {
-          err("chdir: arg count");
-        }
-        return;
-      }
-      
-      if (equal(cp1, "shift")) {
-        if (dolc < 1) {
-          prs("shift: arg count\n");
-          return;
-        }
-        dolv[1] = dolv[0];
-        dolv++;
-        dolc--;
-        return;
-      }
+/* With 'set maxjobs N' a command in background waits until fewer than N
+ * jobs in background are alive. A job is a pipeline, alive as long as its
+ * last command is. Children which end meanwhile are reaped here, and told
+ * by jmesg() if killed by a signal.
+ */
+void jslot()
+{
+  struct timespec ts0, ts1;
+  long max;
+  int i, n, pid, status, waited;
 
-      if (equal(cp1, "login")) {
-        if (prompt) {
-          execv("/bin/login", (char **)(t + DCOM));
-        }
-        prs("login: cannot execte\n");
-        return;
-      }
-  
-      if (equal(cp1, "newgrp")) {
-        if (prompt) {
-          execv("/bin/newgrp", (char **)(t + DCOM));
-        }
-        prs("newgrp: cannot execte\n");
-        return;
+  if ((max = setnum("maxjobs")) <= 0)
+    return;
+  if (max > TOKSIZ)
+    max = TOKSIZ;
+  for (waited = 0;; ) {
+    // A job reaped elsewhere is gone too, and was told there.
+    for (i = n = 0; i < njob; i++) {
+      if ((pid = waitpid(jobpid[i], &status, WNOHANG)) == 0)
+        jobpid[n++] = jobpid[i];
+      else if (pid > 0)
+        jmesg(pid, status);
+    }
+    njob = n;
+    if (njob < max)
+      break;
+    if (!waited++) {
+      COUNT(SJOBW, 1);
+      trace("maxjobs: %d jobs alive, waiting\n", njob);
+      clock_gettime(CLOCK_MONOTONIC, &ts0);
+    }
+    if ((pid = wait(&status)) == -1)
+      break;
+    COUNT(SWAIT, 1);
+    jmesg(pid, status);
+  }
+  if (waited) {
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    COUNT(SJTIM, (ts1.tv_sec - ts0.tv_sec) * 1000000 + (ts1.tv_nsec - ts0.tv_nsec) / 1000);
+  }
+}
+
+/* Counters live in a memfd mapped shared before the first fork, so forked
+ * children count in the same place, and glob maps it again after exec
+ * from the descriptor given with its option -s.
+ */
+void statinit()
+{
+  static long nostats[NSTAT];
+  int fd;
+
+  stats = nostats;
+  fd = memfd_create("tash-stats", MFD_CLOEXEC);
+  if (fd >= 0 && ftruncate(fd, NSTAT * sizeof(long)) == 0) {
+    stats = mmap(NULL, NSTAT * sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (stats != MAP_FAILED) {
+      statfd = fd;
+      return;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  stats = mmap(NULL, NSTAT * sizeof(long), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED)
+    stats = nostats;
+}
+
+// stats [-j] [-r] prints the counters, as JSON with -j, and -r resets them.
+void pstats(unsigned long *t)
+{
+  unsigned long *av;
+  long v[NSTAT];
+  int i, json, reset;
+
+  av = t + DCOM + 1;
+  json = 0;
+  reset = 0;
+  for (; *av != 0; av++) {
+    if (equal((char *)*av, "-j"))
+      json++;
+    else if (equal((char *)*av, "-r"))
+      reset++;
+    else {
+      exitval = 1;
+      err("stats: bad option");
+      return;
+    }
+  }
+
+  for (i = 0; i < NSTAT; i++)
+    v[i] = __atomic_load_n(&stats[i], __ATOMIC_RELAXED);
+  // Failed probes are not execs.
+  v[SEXEC] -= v[SFAIL];
+  if (json) {
+    for (i = 0; i < NSTAT; i++)
+      dprintf(STDOUT, "%c\"%s\":%ld", i ? ',' : '{', statname[i], v[i]);
+    dprintf(STDOUT, "}\n");
+  } else if (!reset) {
+    for (i = 0; i < NSTAT; i++)
+      dprintf(STDOUT, "%-12s %ld\n", statname[i], v[i]);
+  }
+  if (reset)
+    for (i = 0; i < NSTAT; i++)
+      __atomic_store_n(&stats[i], 0, __ATOMIC_RELAXED);
+}
+
+/* Quoted glob characters, and '(' which would start qualifiers, are passed
+ * to glob escaped by '\', the only place where quoting leaves the shell.
+ */
+char *gesc(char *s)
+{
+  char *cp, *p;
+  int i, n;
+
+  if (!(TFLAG(s) & TKQUO))
+    return s;
+  n = TLEN(s);
+  if ((cp = malloc(2 * n + 1)) == NULL)
+    return s;
+  p = cp;
+  for (i = 0; i < n; i++) {
+    if (TQUOTED(s, i) && any(s[i], "[?*\\("))
+      *p++ = '\\';
+    *p++ = s[i];
+  }
+  *p = '\0';
+  return cp;
+}
+
+/* Set capacity of the pipe to 'set pipesize N'. An unprivileged user gets
+ * at most /proc/sys/fs/pipe-max-size, and the kernel rounds the size up.
+ */
+void pipesize(int *pv)
+{
+  long size, max;
+  int fd, n;
+  char buf[24];
+
+  size = setnum("pipesize");
+  n = fcntl(pv[1], F_SETPIPE_SZ, size);
+  if (n < 0 && errno == EPERM) {
+    fd = open("/proc/sys/fs/pipe-max-size", 0);
+    if (fd >= 0) {
+      n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+      buf[n > 0 ? n : 0] = '\0';
+      max = atol(buf);
+      n = max > 0 ? fcntl(pv[1], F_SETPIPE_SZ, max) : -1;
+    }
+  }
+  if (n < 0)
+    n = fcntl(pv[1], F_GETPIPE_SZ);
+  trace("pipe %d: requested %ld, got %d\n", pv[0], size, n);
+}
+
+// Parse a list like "0-3,8" into the set.
+int cpulist(char *s, cpu_set_t *set)
+{
+  long i, j;
+  char *cp;
+
+  CPU_ZERO(set);
+  for (;;) {
+    i = strtol(s, &cp, 10);
+    if (cp == s || i < 0 || i >= CPU_SETSIZE)
+      return -1;
+    j = i;
+    if (*cp == '-') {
+      s = cp + 1;
+      j = strtol(s, &cp, 10);
+      if (cp == s || j < i || j >= CPU_SETSIZE)
+        return -1;
+    }
+    for (; i <= j; i++)
+      CPU_SET(i, set);
+    if (*cp == '\0' || *cp == '\n')
+      return 0;
+    if (*cp++ != ',')
+      return -1;
+    s = cp;
+  }
+}
+
+int readlist(char *path, cpu_set_t *set)
+{
+  char buf[256];
+  int fd, n;
+
+  if ((fd = open(path, 0)) < 0)
+    return -1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  return cpulist(buf, set);
+}
+
+long readnum(char *path)
+{
+  char buf[24];
+  int fd, n;
+
+  if ((fd = open(path, 0)) < 0)
+    return -1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  buf[n > 0 ? n : 0] = '\0';
+  return n > 0 ? atol(buf) : -1;
+}
+
+int cpukey(int c)
+{
+  char path[80];
+  long pkg, core;
+
+  sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c);
+  pkg = readnum(path);
+  sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", c);
+  core = readnum(path);
+  return (pkg < 0 ? 0 : pkg) << 16 | (core < 0 ? c : core);
+}
+
+/* Order CPUs of the set by package and core, so that SMT siblings come
+ * next to each other and adjacent stages share a core or at least a socket.
+ */
+void cpuorder(cpu_set_t *set)
+{
+  int i, j, c, key[CPU_SETSIZE];
+
+  free(cpuord);
+  cpuset = *set;
+  ncpu = CPU_COUNT(set);
+  if ((cpuord = malloc(ncpu * sizeof(int))) == NULL) {
+    ncpu = 0;
+    return;
+  }
+  for (i = 0, c = 0; c < CPU_SETSIZE && i < ncpu; c++) {
+    if (!CPU_ISSET(c, set))
+      continue;
+    key[c] = cpukey(c);
+    // Insertion sort, CPU number breaks ties.
+    for (j = i++; j > 0 && key[cpuord[j - 1]] > key[c]; j--)
+      cpuord[j] = cpuord[j - 1];
+    cpuord[j] = c;
+  }
+}
+
+// Memory nodes which hold CPUs of the set.
+unsigned long cpunodes(cpu_set_t *set)
+{
+  char path[64];
+  cpu_set_t cs;
+  unsigned long mask;
+  int n;
+
+  mask = 0;
+  for (n = 0; n < 8 * sizeof(mask); n++) {
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+    if (readlist(path, &cs) < 0)
+      continue;
+    CPU_AND(&cs, &cs, set);
+    if (CPU_COUNT(&cs) > 0)
+      mask |= 1UL << n;
+  }
+  return mask;
+}
+
+/* CPUs for 'set cpus auto[:LIST]' in topology order, which is read in the
+ * shell when a pipeline starts and inherited by its stages.
+ */
+int cpuauto(cpu_set_t *set)
+{
+  char *cp;
+
+  if ((cp = getvar("cpus")) == NULL || strncmp(cp, "auto", 4) != 0)
+    return -1;
+  if (cp[4] == ':' ? cpulist(cp + 5, set) : sched_getaffinity(0, sizeof(*set), set))
+    return -1;
+  if (cpuord == NULL || !CPU_EQUAL(set, &cpuset))
+    cpuorder(set);
+  return 0;
+}
+
+/* Place the n-th stage of a pipeline in the child before exec.
+ *   set cpus LIST       every stage on CPUs of the list
+ *   set cpus auto[:LIST] stage n on the n-th CPU in topology order
+ *   set numa MODE[:NODES] memory policy local, preferred, bind or interleave,
+ *                        on nodes of the CPUs given if no nodes
+ */
+void place(int n)
+{
+  cpu_set_t set;
+  unsigned long mask;
+  char *cp, *mode;
+  int pol, c;
+
+  cp = getvar("cpus");
+  mode = getvar("numa");
+  if ((cp == NULL || *cp == '\0') && (mode == NULL || *mode == '\0'))
+    return;
+  if (cp != NULL && *cp != '\0') {
+    if (strncmp(cp, "auto", 4) == 0) {
+      if (cpuauto(&set) < 0) {
+        err("cpus: bad list");
+        return;
+      }
+      if (ncpu > 0) {
+        c = cpuord[n % ncpu];
+        CPU_ZERO(&set);
+        CPU_SET(c, &set);
+      }
+    } else if (cpulist(cp, &set) < 0) {
+      err("cpus: bad list");
+      return;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+      trace("stage %d: cannot set CPUs %s\n", n, cp);
+    else
+      trace("stage %d: pid %d on %d CPUs from %s\n", n, getpid(), CPU_COUNT(&set), cp);
+  } else {
+    // Nodes of the CPUs the stage may run on
+    sched_getaffinity(0, sizeof(set), &set);
+  }
+
+  if (mode == NULL || *mode == '\0')
+    return;
+  mask = 0;
+  if ((cp = strchr(mode, ':')) != NULL) {
+    cpu_set_t ns;
+
+    if (cpulist(cp + 1, &ns) < 0) {
+      err("numa: bad nodes");
+      return;
+    }
+    for (c = 0; c < 8 * sizeof(mask); c++)
+      if (CPU_ISSET(c, &ns))
+        mask |= 1UL << c;
+  }
+
+  if (strncmp(mode, "local", 5) == 0) {
+    pol = MPOL_LOCAL;
+    mask = 0;
+  } else if (strncmp(mode, "preferred", 9) == 0) {
+    pol = MPOL_PREFERRED;
+  } else if (strncmp(mode, "bind", 4) == 0) {
+    pol = MPOL_BIND;
+  } else if (strncmp(mode, "interleave", 10) == 0) {
+    pol = MPOL_INTERLEAVE;
+  } else {
+    err("numa: bad mode");
+    return;
+  }
+  if (pol != MPOL_LOCAL && mask == 0)
+    mask = cpunodes(&set);
+
+  if (syscall(SYS_set_mempolicy, pol, pol == MPOL_LOCAL ? NULL : &mask,
+        pol == MPOL_LOCAL ? 0 : 8 * sizeof(mask) + 1) < 0)
+    trace("stage %d: cannot set memory policy %s\n", n, mode);
+  else
+    trace("stage %d: memory policy %s on nodes 0x%lx\n", n, mode, mask);
+}
+
+/* Move n bytes from the pipe to the file with splice(2), or through
+ * a buffer if the file cannot be spliced to, and return how many are
+ * left in the pipe after an error, 0 if none.
+ */
+int drain(int from, int to, int n)
+{
+  char buf[4096];
+  int m;
+
+  while (n > 0) {
+    m = splice(from, NULL, to, NULL, n, SPLICE_F_MOVE);
+    if (m < 0 && errno == EINVAL) {
+      m = read(from, buf, n < sizeof(buf) ? n : sizeof(buf));
+      // Taken from the pipe even if not written
+      if (m > 0 && write(to, buf, m) != m) {
+        n -= m;
+        m = -1;
+      }
+    }
+    if (m <= 0)
+      return n;
+    n -= m;
+  }
+  return 0;
+}
+
+/* A file of fanout() which cannot be written is told once and written to
+ * /dev/null instead, with the rest of what it missed, so that its pipe is
+ * still read and the other files get all.
+ */
+int fdrop(char *name, int from, int n)
+{
+  int fd;
+
+  prs(name);
+  prs(": write error\n");
+  if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+    drain(from, fd, n);
+  return fd;
+}
+
+/* 'cmd > a > b >> c', the command writes to a pipe and this child stays as
+ * helper which duplicates the data to all files but the last with tee(2)
+ * into a pipe of each file, and moves it with splice(2) without copying it
+ * to user space. The helper exits with the status of the command.
+ * Only called with two files or more.
+ */
+void fanout(unsigned long *v)
+{
+  int i, k, m, n, pid, status, pv[2], fd[TOKSIZ / 2], tp[TOKSIZ / 2][2];
+  char *name, *names[TOKSIZ / 2];
+
+  for (k = 0; v[2 * k] != 0; k++) {
+    name = names[k] = wsub(v[2 * k]);
+    fd[k] = -1;
+    if (v[2 * k + 1] & FCAT) {
+      fd[k] = open(name, 1);
+      if (fd[k] >= 0)
+        lseek(fd[k], 0, SEEK_END);
+    }
+    if (fd[k] < 0 && (fd[k] = creat(name, 0666)) < 0) {
+      prs(name);
+      err(": cannot creat");
+      exit(-1);
+    }
+  }
+
+  if (pipe(pv) < 0 || (pid = tfork()) == -1) {
+    err("try again");
+    exit(-1);
+  }
+  // The command
+  if (pid == 0) {
+    dup2(pv[1], STDOUT);
+    close(pv[0]);
+    close(pv[1]);
+    for (i = 0; i < k; i++)
+      close(fd[i]);
+    return;
+  }
+
+  close(pv[1]);
+  close(STDIN);
+  n = fcntl(pv[0], F_GETPIPE_SZ);
+  for (i = 0; i < k - 1; i++) {
+    if (pipe(tp[i]) < 0) {
+      err("try again");
+      exit(-1);
+    }
+    // Same size, so tee(2) never stops short of what is in the pipe.
+    if (n > 0)
+      fcntl(tp[i][1], F_SETPIPE_SZ, n);
+  }
+
+  for (;;) {
+    // Blocks until the command writes, 0 when it is done.
+    if ((n = tee(pv[0], tp[0][1], INT_MAX, 0)) <= 0)
+      break;
+    for (i = 1; i < k - 1; i++)
+      if (tee(pv[0], tp[i][1], n, 0) != n)
+        break;
+    if (i < k - 1)
+      break;
+    for (i = 0; i < k; i++) {
+      if ((m = drain(i < k - 1 ? tp[i][0] : pv[0], fd[i], n)) == 0)
+        continue;
+      close(fd[i]);
+      if ((fd[i] = fdrop(names[i], i < k - 1 ? tp[i][0] : pv[0], m)) < 0)
+        break;
+    }
+    if (i < k)
+      break;
+  }
+
+  // A command still writing when the loop stops early gets EPIPE, not a
+  // full pipe nobody reads.
+  close(pv[0]);
+  for (i = 0; i < k - 1; i++) {
+    close(tp[i][0]);
+    close(tp[i][1]);
+  }
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    continue;
+  if (status & 0x7f) {
+    signal(status & 0x7f, SIG_DFL);
+    kill(getpid(), status & 0x7f);
+  }
+  exit((status >> 8) & 0xff);
+}
+
+/* Built-in commands which may run as a stage of a pipeline on a thread of
+ * the shell. They read and write the descriptors given, never STDIN or
+ * STDOUT, and say nothing to the shell but the exit status.
+ */
+int bwrite(int fd, char *s, int n)
+{
+  int m;
+
+  while (n > 0) {
+    if ((m = write(fd, s, n)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    s += m;
+    n -= m;
+  }
+  return 0;
+}
+
+int becho(int in, int out, char **av)
+{
+  char buf[LINSIZ];
+  int n, m, nl;
+
+  nl = 1;
+  if (*av != NULL && equal(*av, "-n")) {
+    nl = 0;
+    av++;
+  }
+  n = 0;
+  for (; *av != NULL; av++) {
+    m = strlen(*av);
+    if (n + m + 1 > sizeof(buf)) {
+      if (bwrite(out, buf, n) < 0)
+        return 1;
+      n = 0;
+    }
+    if (m + 1 > sizeof(buf)) {
+      if (bwrite(out, *av, m) < 0)
+        return 1;
+    } else {
+      memcpy(buf + n, *av, m);
+      n += m;
+    }
+    if (av[1] != NULL || nl)
+      buf[n++] = av[1] != NULL ? ' ' : '\n';
+  }
+  if (*av == NULL && n == 0 && nl)
+    buf[n++] = '\n';
+  return bwrite(out, buf, n) < 0;
+}
+
+int bcat(int in, int out, char **av)
+{
+  char buf[65536];
+  int fd, n, ret;
+
+  ret = 0;
+  do {
+    fd = in;
+    if (*av != NULL && !equal(*av, "-")) {
+      if ((fd = open(*av, O_RDONLY | O_CLOEXEC)) < 0) {
+        dprintf(STDERR, "cat: %s: cannot open\n", *av);
+        ret = 1;
+        continue;
+      }
+    }
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        ret = 1;
+        break;
+      }
+      if (bwrite(out, buf, n) < 0) {
+        if (fd != in)
+          close(fd);
+        return 1;
+      }
+    }
+    if (fd != in)
+      close(fd);
+  } while (*av != NULL && *++av != NULL);
+  return ret;
+}
+
+void *brun(void *arg)
+{
+  struct bstage *b;
+  int fd;
+
+  b = arg;
+  b->status = b->func(b->in, b->out, b->argv + 1);
+  // Close under the lock, so that a child forked now never keeps them.
+  pthread_mutex_lock(&bslock);
+  fd = b->in;
+  b->in = -1;
+  close(fd);
+  fd = b->out;
+  b->out = -1;
+  close(fd);
+  pthread_mutex_unlock(&bslock);
+  return NULL;
+}
+
+// Wait for all built-in stages, the exit status is the one of the last.
+int bjoin()
+{
+  struct bstage *b;
+  int status;
+
+  status = 0;
+  while ((b = bstages) != NULL) {
+    pthread_join(b->tid, NULL);
+    if (b->next == NULL)
+      status = b->status;
+    bstages = b->next;
+    free(b->argv);
+    free(b);
+  }
+  return status;
+}
+
+void rdsync();
+
+/* Start a built-in command of a pipeline on a thread with its own copies of
+ * the descriptors, return 0 if it has to be forked as usual. Redirection
+ * is done here as the child would, and a 'cat' which would read the
+ * terminal of the shell is left to a process which can be interrupted.
+ */
+int bstart(unsigned long *t, int *pf1, int *pf2)
+{
+  struct bstage *b, **bp;
+  unsigned long flag, *t1;
+  int (*func)(int, int, char **);
+  char *cp, **av;
+  int n, in, out;
+
+  flag = t[DFLG];
+  if (!(flag & (FPIN | FPOU)) || (flag & (FAND | FTEE)) || deadline.tv_sec != 0)
+    return 0;
+  if (equal((char *)t[DCOM], "echo"))
+    func = becho;
+  else if (equal((char *)t[DCOM], "cat") && (t[DCOM + 1] || t[DLEF] || (flag & FPIN)))
+    func = bcat;
+  else
+    return 0;
+  n = 0;
+  for (t1 = t + DCOM; *t1 != 0; t1++) {
+    if (TFLAG(*t1) & TKGLB)
+      return 0;
+    n += sizeof(char *) + strlen((char *)*t1) + 1;
+  }
+
+  if (flag & FPIN)
+    in = fcntl(pf1[0], F_DUPFD_CLOEXEC, 3);
+  else if (t[DLEF])
+    in = open((char *)t[DLEF], O_RDONLY | O_CLOEXEC);
+  else {
+    // The thread reads STDIN where the shell is, not where 'read' got to.
+    rdsync();
+    in = fcntl(STDIN, F_DUPFD_CLOEXEC, 3);
+  }
+  if (flag & FPOU)
+    out = fcntl(pf2[1], F_DUPFD_CLOEXEC, 3);
+  else if (t[DRIT] && (flag & FCAT) && (out = open((char *)t[DRIT], O_WRONLY | O_CLOEXEC)) >= 0)
+    lseek(out, 0, SEEK_END);
+  else if (t[DRIT])
+    out = open((char *)t[DRIT], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  else
+    out = fcntl(STDOUT, F_DUPFD_CLOEXEC, 3);
+  if (in < 0 || out < 0) {
+    if (in < 0 && t[DLEF]) {
+      prs((char *)t[DLEF]);
+      prs(": cannot open\n");
+    } else if (out < 0 && t[DRIT]) {
+      prs((char *)t[DRIT]);
+      prs(": cannot creat\n");
+    }
+    if (in >= 0)
+      close(in);
+    if (out >= 0)
+      close(out);
+    in = out = -1;
+  }
+
+  // Arguments are copied, the command line is substituted in static buffers.
+  b = malloc(sizeof(*b));
+  if (b != NULL && (b->argv = malloc(n + sizeof(char *))) == NULL) {
+    free(b);
+    b = NULL;
+  }
+  if (b == NULL) {
+    prs("Out of memory\n");
+    if (in >= 0) {
+      close(in);
+      close(out);
+    }
+    in = -1;
+    goto OUT;
+  }
+  av = b->argv;
+  cp = (char *)(av + (t1 - (t + DCOM)) + 1);
+  for (t1 = t + DCOM; *t1 != 0; t1++) {
+    *av++ = strcpy(cp, (char *)*t1);
+    cp += strlen(cp) + 1;
+  }
+  *av = NULL;
+  b->func = func;
+  b->in = in;
+  b->out = out;
+  b->next = NULL;
+  if (in >= 0 && pthread_create(&b->tid, NULL, brun, b) != 0) {
+    prs("try again\n");
+    close(in);
+    close(out);
+    in = -1;
+  }
+  if (in < 0) {
+    free(b->argv);
+    free(b);
+  } else {
+    trace("stage %d: %s on a thread\n", stage, b->argv[0]);
+    for (bp = &bstages; *bp != NULL; bp = &(*bp)->next)
+      continue;
+    *bp = b;
+  }
+
+OUT:
+  stage++;
+  if (flag & FPIN) {
+    close(pf1[0]);
+    close(pf1[1]);
+  }
+  if (!(flag & FPOU)) {
+    n = bjoin();
+    exitval = in < 0 ? 1 : n;
+    // Reap forked stages before this one.
+    while (waitpid(-1, &n, WNOHANG) > 0)
+      continue;
+  }
+  return 1;
+}
+
+/* Whether the shell has nothing left to wait for, so the last command may
+ * replace it.
+ */
+int nochild()
+{
+  int pid, status;
+
+  if (bstages != NULL)
+    return 0;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    continue;
+  return pid == -1 && errno == ECHILD;
+}
+
+struct builtin *bfind(char *s);
+struct tash_builtin *dynfind(char *s);
+
+/* Exec a simple command in the child, through glob if any argument has
+ * glob characters, or else searched as the original shell did. A built-in
+ * loaded by 'enable -f' is called instead.
+ */
+void cexec(unsigned long *t)
+{
+  struct builtin *bp;
+  struct tash_builtin *tb;
+  unsigned long *t1;
+  char *cp1, *cp2;
+
+  if ((bp = bfind((char *)t[DCOM])) != NULL) {
+    bp->func(t);
+    exit(exitval);
+  }
+  if ((tb = dynfind((char *)t[DCOM])) != NULL) {
+    for (t1 = t + DCOM; *t1 != 0; t1++)
+      continue;
+    exitval = tb->func(t1 - (t + DCOM), (char **)(t + DCOM));
+    exit(exitval);
+  }
+
+  // Glob characters were marked by token(), arguments need no scan.
+  for (t1 = t + DCOM; *t1 != 0; t1++)
+    if (TFLAG(*t1) & TKGLB)
+      break;
+  if (*t1 != 0) {
+    for (t1 = t + DCOM; *t1 != 0; t1++)
+      *t1 = (unsigned long)gesc((char *)*t1);
+    t1 = t + DCOM;
+    cp1 = linep;
+    // Option -bN of glob runs the command in batches N at a time.
+    if (setnum("batch") > 0) {
+      *--t1 = (unsigned long)cp1;
+      cp2 = "-b";
+      while ((*cp1 = *cp2++) != '\0')
+        cp1++;
+      cp2 = getvar("batch");
+      while ((*cp1++ = *cp2++) != '\0')
+        continue;
+    }
+    // Option -sN of glob counts in stats mapped from descriptor N.
+    if (statfd >= 0 && fcntl(statfd, F_SETFD, 0) == 0) {
+      *--t1 = (unsigned long)cp1;
+      sprintf(cp1, "-s%d", statfd);
+    }
+    *--t1 = (unsigned long)"glob";//"/etc/glob";
+    COUNT(SEXEC, 1);
+    execv((char *)*t1, (char **)t1);
+    COUNT(SFAIL, 1);
+    prs("glob: cannot execute\n");
+    exit(-1);
+  }
+
+  *linep = '\0';
+  texec((char *)t[DCOM], t);
+  cp1 = linep;
+  cp2 = "/usr/bin/";
+  while ((*cp1 = *cp2++) != '\0')
+    cp1++;
+  cp2 = (char *)t[DCOM];
+  while ((*cp1++ = *cp2++) != '\0')
+    continue;
+  texec(linep + 4, t);
+  texec(linep, t);
+  prs((char *)t[DCOM]);
+  err(": not found");
+  exit(-1);
+}
+
+// Block of a regular STDIN read ahead by 'read', the offset of STDIN is
+// past its end while any of it is left.
+char rdbuf[65536];
+int rdp;
+int rdn;
+int rdkind;  // 0 unknown, 1 regular file, 2 pipe, 3 else
+int rdpv[2] = {-1, -1};
+
+/* Give back to STDIN what 'read' read ahead, before anyone else reads it:
+ * the shell itself, a child forked, or the parent after the shell exits.
+ */
+void rdsync()
+{
+  if (rdp < rdn)
+    lseek(STDIN, rdp - rdn, SEEK_CUR);
+  rdp = rdn = 0;
+  rdkind = 0;
+  // Where the commands parsed ahead have taken the input to
+  if (aqpend) {
+    lseek(STDIN, aqpos, SEEK_SET);
+    aqfpos = aqpos;
+    aqpend = 0;
+  }
+}
+
+/* Take from the pipe on STDIN what is there up to the first '\n', at most
+ * max bytes, and return how many. The pipe is peeked with tee(2) into a
+ * pipe of our own, so no more than the line is taken.
+ */
+int rdpeek(char *buf, int max)
+{
+  char *cp;
+  int n;
+
+  // Blocks until there is data, 0 only at end of file.
+  if ((n = tee(STDIN, rdpv[1], max, 0)) <= 0)
+    return n;
+  n = read(rdpv[0], buf, n);
+  cp = memchr(buf, '\n', n);
+  if (cp)
+    n = cp + 1 - buf;
+  COUNT(SREAD, 1);
+  return read(STDIN, buf, n);
+}
+
+/* Read a line of STDIN, and return its length with the '\n', 0 at end of
+ * file. A regular file is read by blocks, and the rest of a block is given
+ * back by rdsync() only when needed. A pipe is peeked with tee(2) into a
+ * pipe of our own, so a line takes 3 system calls and no more than the line
+ * is taken. Anything else is read by bytes, as the shell reads commands.
+ */
+int rdline(char **lp)
+{
+  static char *lb;
+  static int lsz;
+  struct stat st;
+  char *cp;
+  int n, len;
+
+  if (aqpend)
+    rdsync();
+  if (rdkind == 0) {
+    rdkind = 3;
+    if (fstat(STDIN, &st) == 0 && S_ISREG(st.st_mode))
+      rdkind = 1;
+    else if (S_ISFIFO(st.st_mode) && (rdpv[0] >= 0 || pipe2(rdpv, O_CLOEXEC) == 0))
+      rdkind = 2;
+  }
+
+  len = 0;
+  for (;;) {
+    if (lsz - len < sizeof(rdbuf) + 1) {
+      lsz = 2 * lsz + sizeof(rdbuf) + 1;
+      if ((lb = realloc(lb, lsz)) == NULL) {
+        err("Out of memory");
+        lsz = 0;
+        return 0;
+      }
+    }
+
+    if (rdkind == 1) {
+      if (rdp == rdn) {
+        COUNT(SREAD, 1);
+        rdp = 0;
+        if ((rdn = read(STDIN, rdbuf, sizeof(rdbuf))) <= 0) {
+          rdn = 0;
+          break;
+        }
+      }
+      cp = memchr(rdbuf + rdp, '\n', rdn - rdp);
+      n = cp ? cp + 1 - (rdbuf + rdp) : rdn - rdp;
+      memcpy(lb + len, rdbuf + rdp, n);
+      rdp += n;
+      len += n;
+    } else if (rdkind == 2) {
+      if ((n = rdpeek(lb + len, sizeof(rdbuf))) <= 0)
+        break;
+      cp = memchr(lb + len, '\n', n);
+      len += n;
+    } else {
+      COUNT(SREAD, 1);
+      if (read(STDIN, lb + len, 1) != 1)
+        break;
+      cp = lb[len++] == '\n' ? lb : NULL;
+    }
+    if (cp != NULL)
+      break;
+  }
+
+  lb[len] = '\0';
+  *lp = lb;
+  return len;
+}
+
+/* read [name ...] reads a line of STDIN into the names, a word each split
+ * at blanks and the rest of the line to the last one, or all of it to REPLY.
+ * The exit status is 1 at end of file. A stage of a pipeline runs in a
+ * child, where the names would be lost, so it is refused there.
+ */
+void bread(unsigned long *t)
+{
+  unsigned long *av, *v;
+  char *cp, *s;
+  int n;
+
+  if (t[DFLG] & (FPIN | FPOU)) {
+    exitval = 1;
+    prs("read: in a pipeline\n");
+    return;
+  }
+  av = t + DCOM + 1;
+  for (v = av; *v != 0; v++)
+    if (!isname(*(char *)*v)) {
+      exitval = 1;
+      prs("read: bad name\n");
+      return;
+    }
+
+  n = rdline(&cp);
+  exitval = n == 0;
+  if (n > 0 && cp[n - 1] == '\n')
+    cp[--n] = '\0';
+  if (*av == 0) {
+    setvar("REPLY", cp);
+    return;
+  }
+  for (; *av != 0; av++) {
+    while (*cp == ' ' || *cp == '\t')
+      cp++;
+    s = cp;
+    if (av[1] != 0) {
+      while (*cp != '\0' && *cp != ' ' && *cp != '\t')
+        cp++;
+      if (*cp != '\0')
+        *cp++ = '\0';
+    }
+    setvar((char *)*av, s);
+  }
+}
+
+unsigned long fnv(unsigned long h, void *p, long n)
+{
+  unsigned char *s;
+
+  s = p;
+  while (n-- > 0) {
+    h ^= *s++;
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+// 'set cachedir', or else ~/.cache/tash
+char *cachedir(char *buf)
+{
+  char *cp;
+
+  if ((cp = getvar("cachedir")) != NULL && *cp != '\0') {
+    mkdir(cp, 0700);
+    return cp;
+  }
+  if ((cp = getenv("HOME")) == NULL)
+    cp = "/tmp";
+  snprintf(buf, PATH_MAX, "%s/.cache", cp);
+  mkdir(buf, 0755);
+  strcat(buf, "/tash");
+  mkdir(buf, 0700);
+  return buf;
+}
+
+int ccopy(int from, off_t off, long n, int to)
+{
+  char buf[65536];
+  int m;
+
+  while (n > 0) {
+    m = pread(from, buf, n < sizeof(buf) ? n : sizeof(buf), off);
+    if (m <= 0 || bwrite(to, buf, m) < 0)
+      return -1;
+    off += m;
+    n -= m;
+  }
+  return 0;
+}
+
+struct centry {
+  struct timespec mtime;
+  long size;
+  char name[17];
+};
+
+int cecompar(const void *p1, const void *p2)
+{
+  const struct centry *e1, *e2;
+
+  e1 = p1;
+  e2 = p2;
+  if (e1->mtime.tv_sec != e2->mtime.tv_sec)
+    return e1->mtime.tv_sec < e2->mtime.tv_sec ? -1 : 1;
+  return (e1->mtime.tv_nsec > e2->mtime.tv_nsec) - (e1->mtime.tv_nsec < e2->mtime.tv_nsec);
+}
+
+/* Remove the least recently used entries until the cache is within 'set
+ * cachesize', 64m by default. A hit touches its entry.
+ */
+void cevict(char *dir)
+{
+  struct centry *e, *e1;
+  struct dirent *direp;
+  struct stat st;
+  DIR *d;
+  long total, max;
+  int fd, n, m;
+
+  if ((max = setnum("cachesize")) <= 0)
+    max = 64L << 20;
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return;
+  if ((d = fdopendir(fd)) == NULL) {
+    close(fd);
+    return;
+  }
+
+  e = NULL;
+  n = 0;
+  m = 0;
+  total = 0;
+  while ((direp = readdir(d)) != NULL) {
+    if (strlen(direp->d_name) != 16 || strspn(direp->d_name, "0123456789abcdef") != 16)
+      continue;
+    if (fstatat(dirfd(d), direp->d_name, &st, 0) < 0)
+      continue;
+    if (n == m) {
+      m = m ? 2 * m : 64;
+      if ((e1 = realloc(e, m * sizeof(*e))) == NULL)
+        break;
+      e = e1;
+    }
+    e[n].mtime = st.st_mtim;
+    e[n].size = st.st_size;
+    strcpy(e[n++].name, direp->d_name);
+    total += st.st_size;
+  }
+
+  if (total > max) {
+    qsort(e, n, sizeof(*e), cecompar);
+    for (e1 = e; e1 < e + n && total > max; e1++) {
+      trace("cache %s: evicted\n", e1->name);
+      if (unlinkat(dirfd(d), e1->name, 0) == 0)
+        total -= e1->size;
+    }
+  }
+  free(e);
+  closedir(d);
+}
+
+/* Hash the arguments as they run, with glob patterns expanded by 'glob -p'
+ * in a child, so that the key changes with the files matched.
+ */
+unsigned long ghash(unsigned long h, unsigned long *av)
+{
+  char *argv[TOKSIZ + 3], buf[4096];
+  unsigned long *t1;
+  int i, n, pid, status, pv[2];
+
+  for (t1 = av; *t1 != 0; t1++)
+    if (TFLAG(*t1) & TKGLB)
+      break;
+  if (*t1 == 0 || pipe2(pv, O_CLOEXEC) < 0) {
+    for (t1 = av; *t1 != 0; t1++)
+      h = fnv(h, (char *)*t1, strlen((char *)*t1) + 1);
+    return h;
+  }
+
+  rdsync();
+  if ((pid = tfork()) == 0) {
+    dup2(pv[1], STDOUT);
+    argv[0] = "glob";
+    argv[1] = "-p";
+    for (i = 0; av[i] != 0; i++)
+      argv[i + 2] = gesc((char *)av[i]);
+    argv[i + 2] = NULL;
+    execv(argv[0], argv);
+    exit(-1);
+  }
+  close(pv[1]);
+  if (pid > 0)
+    while ((n = read(pv[0], buf, sizeof(buf))) > 0)
+      h = fnv(h, buf, n);
+  close(pv[0]);
+  while (pid > 0 && waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    continue;
+  return h;
+}
+
+/* cache [-i file] [-h file] [-e name] command [arg ...] runs the command
+ * once, and replays its stdout, stderr and exit status from the cache
+ * while the command, the directory, the size and mtime of files given by
+ * -i, the content of files given by -h and variables given by -e are the
+ * same. Output of a command run is replayed when it is done.
+ */
+void bcache(unsigned long *t)
+{
+  unsigned long *av, h;
+  char dbuf[PATH_MAX], path[PATH_MAX + 32], tmp[PATH_MAX + 48], buf[65536];
+  char *dir, *cp, *name;
+  struct chead ch;
+  struct stat st;
+  int fd, efd, n, pid;
+
+  h = 0xcbf29ce484222325;
+  for (av = t + DCOM + 1; *av != 0 && *(char *)*av == '-'; av += 2) {
+    cp = (char *)*av;
+    if (equal(cp, "--")) {
+      av++;
+      break;
+    }
+    if (av[1] == 0 || cp[2] != '\0' || !any(cp[1], "ihe")) {
+      exitval = 1;
+      err("cache: bad option");
+      return;
+    }
+    name = (char *)av[1];
+    h = fnv(h, cp, 3);
+    h = fnv(h, name, strlen(name) + 1);
+    if (cp[1] == 'e') {
+      if ((cp = getvar(name)) != NULL)
+        h = fnv(h, cp, strlen(cp) + 1);
+    } else if ((fd = open(name, O_RDONLY | O_CLOEXEC)) >= 0) {
+      if (cp[1] == 'i' && fstat(fd, &st) == 0) {
+        h = fnv(h, &st.st_size, sizeof(st.st_size));
+        h = fnv(h, &st.st_mtim, sizeof(st.st_mtim));
+      } else {
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+          h = fnv(h, buf, n);
+      }
+      close(fd);
+    }
+  }
+  if (*av == 0) {
+    exitval = 1;
+    err("cache: arg count");
+    return;
+  }
+  h = ghash(h, av);
+  if (getcwd(buf, sizeof(buf)) != NULL)
+    h = fnv(h, buf, strlen(buf));
+
+  dir = cachedir(dbuf);
+  snprintf(path, sizeof(path), "%s/%016lx", dir, h);
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+    if (pread(fd, &ch, sizeof(ch), 0) == sizeof(ch) && ch.magic == CMAGIC) {
+      trace("cache %016lx: hit\n", h);
+      utimensat(AT_FDCWD, path, NULL, 0);
+      ccopy(fd, sizeof(ch), ch.nout, STDOUT);
+      ccopy(fd, sizeof(ch) + ch.nout, ch.nerr, STDERR);
+      close(fd);
+      exitval = ch.status;
+      return;
+    }
+    close(fd);
+  }
+
+  // Stdout goes after the header of a new entry, stderr is appended later.
+  trace("cache %016lx: miss\n", h);
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  strcat(tmp, "e");
+  efd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  unlink(tmp);
+  tmp[strlen(tmp) - 1] = '\0';
+  if (fd < 0 || efd < 0) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    if (efd >= 0)
+      close(efd);
+    fd = efd = -1;
+  } else {
+    lseek(fd, sizeof(ch), SEEK_SET);
+  }
+
+  rdsync();
+  if ((pid = tfork()) == -1) {
+    exitval = 1;
+    err("try again");
+    return;
+  }
+  if (pid == 0) {
+    signal(SIGPIPE, SIG_DFL);
+    if (!(t[DFLG] & FINT) && setintr) {
+      signal(SIGINT, SIG_DFL);
+      signal(SIGQUIT, SIG_DFL);
+    }
+    if (fd >= 0) {
+      dup2(fd, STDOUT);
+      dup2(efd, STDERR);
+    }
+    cexec(av - DCOM);
+  }
+  pwait(pid, t);
+  if (fd < 0)
+    return;
+
+  ch.magic = CMAGIC;
+  ch.status = exitval;
+  ch.nout = lseek(fd, 0, SEEK_END) - sizeof(ch);
+  ch.nerr = lseek(efd, 0, SEEK_END);
+  ccopy(fd, sizeof(ch), ch.nout, STDOUT);
+  ccopy(efd, 0, ch.nerr, STDERR);
+  // A command killed by a signal is not kept.
+  if (exitval < 0x80 && ccopy(efd, 0, ch.nerr, fd) == 0 &&
+      pwrite(fd, &ch, sizeof(ch), 0) == sizeof(ch) && rename(tmp, path) == 0)
+    cevict(dir);
+  else
+    unlink(tmp);
+  close(fd);
+  close(efd);
+}
+
+/* 'wait duration' waits for children in background until the deadline,
+ * and leaves the rest running with exit status 124.
+ */
+void bgwait(struct timespec *dl)
+{
+  int i, n, status;
+
+  exitval = 0;
+  for (i = n = 0; i < nbg; i++) {
+    if (exitval == 0 && !pidwait(bgpid[i], dl))
+      exitval = 124;
+    if (waitpid(bgpid[i], &status, WNOHANG) == 0)
+      bgpid[n++] = bgpid[i];
+  }
+  nbg = n;
+}
+
+// Directory watched by 'watch' and names in it which count, all if NULL
+struct wpat {
+  int wd;
+  char *pat;
+};
+
+int wintr;
+
+void wsig(int sig)
+{
+  wintr = 1;
+}
+
+/* Start a run of the command of 'watch' in a process group of its own, so
+ * that it can be cancelled with its children.
+ */
+int wrun(unsigned long *av, int *pfd)
+{
+  int pid, fd;
+
+  *pfd = -1;
+  rdsync();
+  if ((pid = tfork()) == -1) {
+    prs("try again\n");
+    return -1;
+  }
+  if (pid == 0) {
+    setpgid(0, 0);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    if ((fd = open("/dev/null", 0)) >= 0) {
+      dup2(fd, STDIN);
+      close(fd);
+    }
+    cexec(av - DCOM);
+  }
+  setpgid(pid, pid);
+  *pfd = pidopen(pid);
+  return pid;
+}
+
+void wstop(int pid, int pfd)
+{
+  int status;
+
+  if (pid <= 0)
+    return;
+  trace("watch: cancel %d\n", pid);
+  kill(-pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  if (pfd >= 0)
+    close(pfd);
+}
+
+/* watch [-d ms] path ... -- command [arg ...] runs the command, and again
+ * each time a path given changes, as told by inotify(7). A path is a
+ * directory, a file, or a pattern in its last component matched as glob
+ * does. Events are coalesced until none comes for 100ms or the time of
+ * -d, and a run still going is cancelled first. It ends by interrupt.
+ */
+void bwatch(unsigned long *t)
+{
+  struct wpat wp[TOKSIZ];
+  struct pollfd pfd[2];
+  struct inotify_event *ev;
+  struct stat st;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char pbuf[2 * LINSIZ], *pp, *cp, *dir, *pat;
+  unsigned long *av;
+  void (*oint)(int);
+  int ifd, nw, i, n, pid, delay, hit, status;
+
+  delay = 100;
+  av = t + DCOM + 1;
+  if (*av != 0 && equal((char *)*av, "-d") && av[1] != 0) {
+    delay = atoi((char *)av[1]);
+    av += 2;
+  }
+  if ((ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0) {
+    exitval = 1;
+    err("watch: no inotify");
+    return;
+  }
+
+  pp = pbuf;
+  for (nw = 0; *av != 0 && !equal((char *)*av, "--") && nw < TOKSIZ; av++) {
+    cp = (char *)*av;
+    dir = cp;
+    pat = NULL;
+    if ((TFLAG(cp) & TKGLB) || stat(cp, &st) < 0 || !S_ISDIR(st.st_mode)) {
+      // Quoted glob characters are escaped as for glob.
+      pat = gesc(cp);
+      if ((n = strlen(pat)) < pbuf + sizeof(pbuf) - pp)
+        cp = strcpy(pp, pat);
+      if (pat != (char *)*av)
+        free(pat);
+      if (cp != pp) {
+        close(ifd);
+        exitval = 1;
+        err("watch: too long");
+        return;
+      }
+      pp += n + 1;
+      dir = ".";
+      pat = cp;
+      if ((cp = strrchr(pat, '/')) != NULL) {
+        *cp++ = '\0';
+        dir = *pat != '\0' ? pat : "/";
+        pat = cp;
+        if (isglob(dir)) {
+          close(ifd);
+          exitval = 1;
+          err("watch: pattern in directory");
+          return;
+        }
+        unesc(dir);
+      }
+    }
+    wp[nw].wd = inotify_add_watch(ifd, dir,
+        IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    if (wp[nw].wd < 0) {
+      close(ifd);
+      exitval = 1;
+      prs(dir);
+      err(": cannot watch");
+      return;
+    }
+    wp[nw++].pat = pat;
+  }
+  if (nw == 0 || *av == 0 || av[1] == 0) {
+    close(ifd);
+    exitval = 1;
+    err("watch: arg count");
+    return;
+  }
+  av++;
+
+  wintr = 0;
+  oint = signal(SIGINT, wsig);
+  pfd[0].fd = ifd;
+  pfd[0].events = POLLIN;
+  pfd[1].events = POLLIN;
+  pid = wrun(av, &pfd[1].fd);
+  while (!wintr) {
+    // Without pidfd the run is looked for every 100ms.
+    n = poll(pfd, 2, pid > 0 && pfd[1].fd < 0 ? 100 : -1);
+    if (n < 0 && errno != EINTR)
+      break;
+    if (pid > 0 && (pfd[1].fd < 0 || (n > 0 && pfd[1].revents))) {
+      if (waitpid(pid, &status, WNOHANG) == pid) {
+        exitval = status & 0x7f ? (status & 0x7f) | 0x80 : (status >> 8) & 0xff;
+        if (pfd[1].fd >= 0)
+          close(pfd[1].fd);
+        pfd[1].fd = -1;
+        pid = -1;
+      }
+    }
+    if (n <= 0 || !(pfd[0].revents & POLLIN))
+      continue;
+
+    hit = 0;
+    do {
+      while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+        for (cp = buf; cp < buf + n; cp += sizeof(*ev) + ev->len) {
+          ev = (struct inotify_event *)cp;
+          if (ev->mask & IN_Q_OVERFLOW)
+            hit = 1;
+          for (i = 0; i < nw; i++)
+            if (wp[i].wd == ev->wd &&
+                (wp[i].pat == NULL || (ev->len > 0 && match(ev->name, wp[i].pat))))
+              hit = 1;
+        }
+      }
+    } while (hit && !wintr && poll(pfd, 1, delay) > 0);
+    if (!hit || wintr)
+      continue;
+
+    wstop(pid, pfd[1].fd);
+    pid = wrun(av, &pfd[1].fd);
+  }
+
+  wstop(pid, pfd[1].fd);
+  signal(SIGINT, oint);
+  close(ifd);
+}
+
+void control(unsigned long *t);
+void source(char *path);
+
+/* History of interactive commands, a line each in a file which all shells
+ * append to, mapped to be searched. A trigram index of the lines is built
+ * when first searched and extended as lines come, so a search looks only at
+ * lines which have the rarest trigram of the string.
+ */
+#define HBUCK  65536
+
+int hfd = -1;
+ino_t hino;
+char *hmap;
+long hlen;
+// Offsets of the lines in the map, and of the end of the last line
+long *hoff;
+int nhoff;
+int ahoff;
+long hend;
+// Lines with each trigram, by number, up to nidx lines
+struct hbucket {
+  unsigned *v;
+  int n;
+  int a;
+} *hidx;
+int nidx;
+// Line being read
+char hline[LINSIZ];
+int hn;
+
+char *histfile(char *buf)
+{
+  char *cp;
+
+  if ((cp = getvar("histfile")) != NULL && *cp != '\0')
+    return cp;
+  if ((cp = getenv("HOME")) == NULL)
+    cp = "/tmp";
+  snprintf(buf, PATH_MAX, "%s/.tash_history", cp);
+  return buf;
+}
+
+unsigned hgram(char *s)
+{
+  return (((unsigned char)s[0] << 16 | (unsigned char)s[1] << 8 | (unsigned char)s[2]) *
+      2654435761u) >> 16;
+}
+
+void hdrop()
+{
+  int i;
+
+  if (hmap != NULL)
+    munmap(hmap, hlen);
+  hmap = NULL;
+  hlen = hend = 0;
+  nhoff = nidx = 0;
+  if (hidx != NULL)
+    for (i = 0; i < HBUCK; i++)
+      hidx[i].n = 0;
+}
+
+/* Open the history file, again when another shell compacted it, and map
+ * what is new in it. Lines are counted here, the index is left for hindex().
+ */
+int hsync()
+{
+  char buf[PATH_MAX], *path, *cp;
+  struct stat st, st1;
+
+  path = histfile(buf);
+  if (hfd >= 0 && (stat(path, &st) < 0 || st.st_ino != hino)) {
+    close(hfd);
+    hfd = -1;
+  }
+  if (hfd < 0) {
+    hdrop();
+    if ((hfd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+      return 0;
+    fstat(hfd, &st1);
+    hino = st1.st_ino;
+  }
+
+  if (fstat(hfd, &st) < 0)
+    return 0;
+  if (st.st_size < hend)
+    hdrop();
+  if (st.st_size != hlen) {
+    if (hmap != NULL)
+      munmap(hmap, hlen);
+    hmap = NULL;
+    hlen = 0;
+    if (st.st_size > 0) {
+      hmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hfd, 0);
+      if (hmap == MAP_FAILED) {
+        hmap = NULL;
+        hdrop();
+        return 0;
+      }
+      hlen = st.st_size;
+    }
+  }
+
+  while (hend < hlen && (cp = memchr(hmap + hend, '\n', hlen - hend)) != NULL) {
+    if (nhoff == ahoff) {
+      ahoff = 2 * ahoff + 1024;
+      if ((hoff = realloc(hoff, ahoff * sizeof(long))) == NULL) {
+        nhoff = ahoff = 0;
+        hdrop();
+        return 0;
       }
-  
-      if (equal(cp1, "wait")) {
-        pwait(-1, 0);
-        return;
+    }
+    hoff[nhoff++] = hend;
+    hend = cp + 1 - hmap;
+  }
+  return 1;
+}
+
+// Index the trigrams of the lines not yet indexed.
+void hindex()
+{
+  struct hbucket *b;
+  char *s, *e;
+
+  if (hidx == NULL && (hidx = calloc(HBUCK, sizeof(*hidx))) == NULL)
+    return;
+  for (; nidx < nhoff; nidx++) {
+    s = hmap + hoff[nidx];
+    e = memchr(s, '\n', hlen - hoff[nidx]);
+    for (; s + 3 <= e; s++) {
+      b = &hidx[hgram(s)];
+      if (b->n > 0 && b->v[b->n - 1] == nidx)
+        continue;
+      if (b->n == b->a) {
+        b->a = 2 * b->a + 16;
+        if ((b->v = realloc(b->v, b->a * sizeof(unsigned))) == NULL) {
+          b->n = b->a = 0;
+          continue;
+        }
+      }
+      b->v[b->n++] = nidx;
+    }
+  }
+}
+
+int hlinelen(int i)
+{
+  return (char *)memchr(hmap + hoff[i], '\n', hlen - hoff[i]) - (hmap + hoff[i]);
+}
+
+/* Number of the newest line before line 'from' which has the string,
+ * -1 if none.
+ */
+int hfind(char *pat, int from)
+{
+  struct hbucket *b, *b1;
+  char *cp;
+  int i, lo, hi, n;
+
+  n = strlen(pat);
+  if (from > nhoff)
+    from = nhoff;
+  if (n < 3) {
+    for (i = from - 1; i >= 0; i--)
+      if (memmem(hmap + hoff[i], hlinelen(i), pat, n) != NULL)
+        return i;
+    return -1;
+  }
+
+  hindex();
+  if (hidx == NULL)
+    return -1;
+  b = NULL;
+  for (cp = pat; cp + 3 <= pat + n; cp++) {
+    b1 = &hidx[hgram(cp)];
+    if (b == NULL || b1->n < b->n)
+      b = b1;
+  }
+  // Last line in the bucket before 'from'
+  lo = 0;
+  hi = b->n;
+  while (lo < hi) {
+    i = (lo + hi) / 2;
+    if (b->v[i] < from)
+      lo = i + 1;
+    else
+      hi = i;
+  }
+  for (i = lo - 1; i >= 0; i--)
+    if (memmem(hmap + hoff[b->v[i]], hlinelen(b->v[i]), pat, n) != NULL)
+      return b->v[i];
+  return -1;
+}
+
+/* Keep the newest half of 'histsize' bytes of the history, written to a
+ * file of its own which is renamed over it. Other shells find a new file
+ * by its inode.
+ */
+void hcompact(long max)
+{
+  char buf[PATH_MAX], tmp[PATH_MAX + 16], *path, *cp;
+  struct stat st;
+  long off;
+  int fd;
+
+  if (flock(hfd, LOCK_EX) < 0)
+    return;
+  path = histfile(buf);
+  if (stat(path, &st) < 0 || st.st_ino != hino || st.st_size <= max || !hsync()) {
+    flock(hfd, LOCK_UN);
+    return;
+  }
+  off = hlen - max / 2;
+  if ((cp = memchr(hmap + off, '\n', hlen - off)) != NULL)
+    off = cp + 1 - hmap;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) >= 0) {
+    if (bwrite(fd, hmap + off, hlen - off) == 0 && rename(tmp, path) == 0)
+      trace("history: %ld bytes kept\n", hlen - off);
+    else
+      unlink(tmp);
+    close(fd);
+  }
+  flock(hfd, LOCK_UN);
+}
+
+/* Append a line read from the terminal to the history, by one write of
+ * O_APPEND so lines of shells at the same time are never mixed.
+ */
+void hadd(char *s, int n)
+{
+  char buf[PATH_MAX];
+  struct stat st;
+  long max;
+  int i;
+
+  for (i = 0; i < n && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n'); i++)
+    continue;
+  if (i == n)
+    return;
+  for (i = 0; i < 2; i++) {
+    if (!hsync() || flock(hfd, LOCK_SH) < 0)
+      return;
+    // Compacted meanwhile, the file is another one.
+    if (stat(histfile(buf), &st) == 0 && st.st_ino == hino)
+      break;
+    flock(hfd, LOCK_UN);
+  }
+  if (i == 2)
+    return;
+  bwrite(hfd, s, n);
+  flock(hfd, LOCK_UN);
+
+  if ((max = setnum("histsize")) <= 0)
+    max = 4 << 20;
+  if (fstat(hfd, &st) == 0 && st.st_size > max)
+    hcompact(max);
+}
+
+// A character read from the terminal, a line of them goes to the history.
+void hput(int c)
+{
+  if (hn < sizeof(hline))
+    hline[hn++] = c;
+  if (c == '\n') {
+    if (hn < sizeof(hline))
+      hadd(hline, hn);
+    hn = 0;
+  }
+}
+
+void hprint(int i)
+{
+  dprintf(STDOUT, "%6d  %.*s\n", i + 1, hlinelen(i), hmap + hoff[i]);
+}
+
+/* history [n] prints the last n lines of the history, 16 by default, and
+ * history -s string [n] the last n which have the string, newest first.
+ */
+void bhistory(unsigned long *t)
+{
+  unsigned long *av;
+  char *pat;
+  int i, n;
+
+  av = t + DCOM + 1;
+  pat = NULL;
+  if (*av != 0 && equal((char *)*av, "-s")) {
+    if ((pat = (char *)av[1]) == NULL) {
+      exitval = 1;
+      err("history: arg count");
+      return;
+    }
+    av += 2;
+  }
+  n = *av != 0 ? atoi((char *)*av) : 16;
+  if (!hsync()) {
+    exitval = 1;
+    err("history: cannot open");
+    return;
+  }
+
+  if (pat == NULL) {
+    for (i = nhoff > n ? nhoff - n : 0; i < nhoff; i++)
+      hprint(i);
+    return;
+  }
+  exitval = 1;
+  for (i = hfind(pat, nhoff); i >= 0 && n > 0; i = hfind(pat, i), n--) {
+    hprint(i);
+    exitval = 0;
+  }
+}
+
+/* Built-in commands, a function each called with the command tree */
+
+void bchdir(unsigned long *t)
+{
+  if (t[DCOM + 1]) {
+    if (chdir((char *)t[DCOM + 1]) < 0) {
+      exitval = 1;
+      err("chdir: bad directory");
+    }
+  } else {
+    exitval = 1;
+    err("chdir: arg count");
+  }
+}
+
+void bshift(unsigned long *t)
+{
+  if (dolc < 1) {
+    exitval = 1;
+    prs("shift: arg count\n");
+    return;
+  }
+  dolv[1] = dolv[0];
+  dolv++;
+  dolc--;
+}
+
+// login and newgrp replace the interactive shell.
+void blogin(unsigned long *t)
+{
+  char *cp;
+
+  cp = equal((char *)t[DCOM], "login") ? "/bin/login" : "/bin/newgrp";
+  if (prompt) {
+    COUNT(SEXEC, 1);
+    execv(cp, (char **)(t + DCOM));
+    COUNT(SFAIL, 1);
+  }
+  exitval = 1;
+  prs((char *)t[DCOM]);
+  prs(": cannot execte\n");
+}
+
+void bwait(unsigned long *t)
+{
+  struct timespec ts;
+
+  if (t[DCOM + 1] == 0) {
+    pwait(-1, 0);
+    exitval = 0;
+  } else if (!deadl((char *)t[DCOM + 1], &ts)) {
+    exitval = 1;
+    err("wait: bad duration");
+  } else {
+    bgwait(&ts);
+  }
+}
+
+void bset(unsigned long *t)
+{
+  struct var *v;
+
+  if (t[DCOM + 1] == 0) {
+    for (v = vars; v != NULL; v = v->next) {
+      prs(v->name);
+      prs(" ");
+      prs(v->value);
+      prs("\n");
+    }
+  } else if (!isname(*(char *)t[DCOM + 1])) {
+    exitval = 1;
+    err("set: bad name");
+  } else {
+    setvar((char *)t[DCOM + 1], t[DCOM + 2] ? (char *)t[DCOM + 2] : "");
+  }
+}
+
+void bdot(unsigned long *t)
+{
+  if (t[DCOM + 1]) {
+    source((char *)t[DCOM + 1]);
+  } else {
+    exitval = 1;
+    err(".: arg count");
+  }
+}
+
+void bnull(unsigned long *t)
+{
+}
+
+void benable(unsigned long *t);
+
+/* Slots are at bhash() of the names, which has no collisions among them,
+ * so a command is looked for by one compare. A new built-in may need
+ * other multipliers in bhash().
+ */
+#define BHSIZ  32
+
+struct builtin builtins[BHSIZ] = {
+  [2]  = {"wait", bwait},
+  [3]  = {"watch", bwatch},
+  [5]  = {"newgrp", blogin},
+  [7]  = {"cache", bcache},
+  [8]  = {"history", bhistory},
+  [10] = {"stats", pstats},
+  [11] = {"enable", benable},
+  [14] = {"chdir", bchdir},
+  [15] = {"read", bread},
+  [24] = {"login", blogin},
+  [25] = {"set", bset},
+  [27] = {".", bdot},
+  [30] = {"shift", bshift},
+  [31] = {":", bnull},
+};
+
+int bhash(char *s)
+{
+  return (s[0] * 11 + s[1] + strlen(s)) & (BHSIZ - 1);
+}
+
+struct builtin *bfind(char *s)
+{
+  struct builtin *bp;
+
+  if (*s == '\0')
+    return NULL;
+  bp = &builtins[bhash(s)];
+  if (bp->name == NULL || !equal(bp->name, s))
+    return NULL;
+  return bp;
+}
+
+#ifndef NDEBUG
+// A built-in out of the slot of its hash is never found, so tell it at start.
+void bcheck()
+{
+  int i;
+
+  for (i = 0; i < BHSIZ; i++)
+    if (builtins[i].name != NULL && bhash(builtins[i].name) != i) {
+      prs(builtins[i].name);
+      prs(": built-in not at its hash\n");
+      abort();
+    }
+}
+#endif
+
+/* Names in a directory, kept until its mtime changes, for completion. The
+ * directories where commands are looked for are checked at each completion
+ * and read again only when changed.
+ */
+#define DCMAX  32
+#define CMDDIRS  "/bin:/usr/bin"
+
+struct dcache {
+  char *dir;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int exec;  // only executable files
+  char **names;  // each with 1 after its '\0' if a directory
+  int n;
+  struct dcache *next;
+} *dcaches;
+
+int dcompar(const void *p1, const void *p2)
+{
+  return strcmp(*(char **)p1, *(char **)p2);
+}
+
+void dfree(struct dcache *d)
+{
+  int i;
+
+  for (i = 0; i < d->n; i++)
+    free(d->names[i]);
+  free(d->names);
+  d->names = NULL;
+  d->n = 0;
+}
+
+struct dcache *dload(char *dir, int exec)
+{
+  struct dcache *d, **pd;
+  struct dirent *de;
+  struct stat st;
+  DIR *dp;
+  char **v;
+  int i, a, n;
+
+  if (stat(*dir != '\0' ? dir : ".", &st) < 0 || !S_ISDIR(st.st_mode))
+    return NULL;
+  // Found is moved to the front, the last one goes when too many.
+  for (n = 0, pd = &dcaches; (d = *pd) != NULL; pd = &d->next, n++) {
+    if (equal(d->dir, dir) && d->exec == exec) {
+      *pd = d->next;
+      break;
+    }
+    if (n == DCMAX - 1 && d->next != NULL) {
+      dfree(d->next);
+      free(d->next->dir);
+      free(d->next);
+      d->next = NULL;
+    }
+  }
+  if (d == NULL) {
+    if ((d = calloc(1, sizeof(*d))) == NULL || (d->dir = strdup(dir)) == NULL) {
+      free(d);
+      return NULL;
+    }
+    d->exec = exec;
+  }
+  d->next = dcaches;
+  dcaches = d;
+  if (d->names != NULL && d->dev == st.st_dev && d->ino == st.st_ino &&
+      d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec)
+    return d;
+
+  trace("complete: read %s\n", *dir != '\0' ? dir : ".");
+  dfree(d);
+  d->dev = st.st_dev;
+  d->ino = st.st_ino;
+  d->mtime = st.st_mtim;
+  if ((dp = opendir(*dir != '\0' ? dir : ".")) == NULL)
+    return d;
+  a = 0;
+  while ((de = readdir(dp)) != NULL) {
+    if (equal(de->d_name, ".") || equal(de->d_name, ".."))
+      continue;
+    if (exec && faccessat(dirfd(dp), de->d_name, X_OK, 0) < 0)
+      continue;
+    if (d->n == a) {
+      a = 2 * a + 64;
+      if ((v = realloc(d->names, a * sizeof(char *))) == NULL)
+        break;
+      d->names = v;
+    }
+    i = strlen(de->d_name);
+    if ((d->names[d->n] = malloc(i + 2)) == NULL)
+      break;
+    memcpy(d->names[d->n], de->d_name, i + 1);
+    d->names[d->n][i + 1] = de->d_type == DT_DIR ||
+        ((de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) && !exec &&
+         fstatat(dirfd(dp), de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+    d->n++;
+  }
+  closedir(dp);
+  qsort(d->names, d->n, sizeof(char *), dcompar);
+  return d;
+}
+
+// Line being edited, the part of it not yet read by readc(), and the terminal
+char ebuf[LINSIZ];
+int elen;
+int epos;
+char *ep;
+char *eend;
+char *eprompt;
+struct termios etio;
+
+// Output of a redraw, written at once
+char eout[4 * LINSIZ];
+int neout;
+
+void eput(char *s, int n)
+{
+  if (n > sizeof(eout) - neout)
+    n = sizeof(eout) - neout;
+  memcpy(eout + neout, s, n);
+  neout += n;
+}
+
+void eflush()
+{
+  bwrite(STDOUT, eout, neout);
+  neout = 0;
+}
+
+/* The line is UTF-8, a character a column, so the cursor moves over
+ * and deletes whole sequences of bytes.
+ */
+#define UTF8CONT(c)  (((c) & 0xc0) == 0x80)
+
+int ecols(char *s, int n)
+{
+  int i, m;
+
+  for (i = m = 0; i < n; i++)
+    if (!UTF8CONT(s[i]))
+      m++;
+  return m;
+}
+
+int eprev(int pos)
+{
+  while (pos > 0 && UTF8CONT(ebuf[--pos]))
+    continue;
+  return pos;
+}
+
+int enext(int pos)
+{
+  while (pos < elen && UTF8CONT(ebuf[++pos]))
+    continue;
+  return pos;
+}
+
+/* Draw the line again from where the cursor is at column 'col' of the
+ * line, with 'pre' before it, and leave the cursor at 'pos'.
+ */
+int edraw(int col, char *pre, char *s, int n, int pos)
+{
+  char buf[32];
+  int m;
+
+  m = strlen(pre);
+  if (col > 0)
+    eput(buf, sprintf(buf, "\033[%dD", col));
+  eput(pre, m);
+  eput(s, n);
+  eput("\033[K", 3);
+  if (n > pos)
+    eput(buf, sprintf(buf, "\033[%dD", ecols(s + pos, n - pos)));
+  eflush();
+  return ecols(pre, m) + ecols(s, pos);
+}
+
+/* Read a byte of a key within ms milliseconds, -1 if none comes, as after
+ * ESC pressed alone.
+ */
+int ekey(int ms)
+{
+  struct pollfd pfd;
+  unsigned char c;
+
+  pfd.fd = STDIN;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, ms) != 1 || read(STDIN, &c, 1) != 1)
+    return -1;
+  return c;
+}
+
+/* Read the rest of a key starting with c into kb: the bytes of a UTF-8
+ * character, or of an escape sequence ESC [ or ESC O, parameters and the
+ * final byte, with the final byte and the first parameter returned in
+ * *fin and *par. Return the length, 0 for ESC alone or with another key.
+ */
+int ekeys(unsigned char c, unsigned char *kb, int *fin, int *par)
+{
+  int k, n, b;
+
+  kb[0] = c;
+  if (c >= 0xc0) {
+    n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+    for (k = 1; k < n && (b = ekey(100)) >= 0 && UTF8CONT(b); k++)
+      kb[k] = b;
+    return k;
+  }
+  if (c != 0x1b)
+    return 1;
+  *fin = 0;
+  *par = 0;
+  if ((b = ekey(50)) != '[' && b != 'O')
+    return 0;
+  // Parameters and intermediates up to the final byte
+  for (k = 0; k < 16 && (b = ekey(50)) >= 0x20 && b < 0x40; k++)
+    if (b >= '0' && b <= '9')
+      *par = *par * 10 + b - '0';
+  if (b < 0x40 || b > 0x7e)
+    return 0;
+  *fin = b;
+  return 1;
+}
+
+// Candidates of a completion
+char **cands;
+int ncand;
+int acand;
+
+void cadd(char *s)
+{
+  char **v;
+
+  if (ncand == acand) {
+    acand = 2 * acand + 64;
+    if ((v = realloc(cands, acand * sizeof(char *))) == NULL) {
+      acand = ncand;
+      return;
+    }
+    cands = v;
+  }
+  cands[ncand++] = s;
+}
+
+/* Complete the word before the cursor, as a command in the first word of
+ * a command, or else as a file. Names are matched by the pattern of the
+ * word with '*' after it, as glob does. A second tab lists them all.
+ */
+int ecomplete(int again)
+{
+  static char pat[LINSIZ + 2], dir[LINSIZ];
+  struct dcache *d;
+  char *cp, *base, *dirs, *slash;
+  int i, j, w, n, cmd, glob;
+
+  for (w = epos; w > 0 && !any(ebuf[w - 1], " \t;&|^()<>"); w--)
+    continue;
+  for (i = w; i > 0 && (ebuf[i - 1] == ' ' || ebuf[i - 1] == '\t'); i--)
+    continue;
+  cmd = i == 0 || any(ebuf[i - 1], ";&|^(");
+
+  n = epos - w;
+  memcpy(pat, ebuf + w, n);
+  pat[n] = '\0';
+  slash = strrchr(pat, '/');
+  if (slash != NULL)
+    cmd = 0;
+  base = slash != NULL ? slash + 1 : pat;
+  glob = isglob(base);
+  dir[0] = '\0';
+  if (slash != NULL) {
+    memcpy(dir, pat, slash + 1 - pat);
+    dir[slash + 1 - pat] = '\0';
+  }
+  memmove(pat, base, strlen(base) + 1);
+  strcat(pat, "*");
+
+  ncand = 0;
+  if (cmd) {
+    for (i = 0; i < BHSIZ; i++)
+      if (builtins[i].name != NULL && match(builtins[i].name, pat))
+        cadd(builtins[i].name);
+    dirs = CMDDIRS;
+    for (cp = dirs; *cp != '\0'; cp += *cp == ':') {
+      for (i = 0; *cp != '\0' && *cp != ':'; )
+        dir[i++] = *cp++;
+      dir[i++] = '/';
+      dir[i] = '\0';
+      if ((d = dload(dir, 1)) != NULL)
+        for (j = 0; j < d->n; j++)
+          if (match(d->names[j], pat))
+            cadd(d->names[j]);
+    }
+    dir[0] = '\0';
+    qsort(cands, ncand, sizeof(char *), dcompar);
+    for (i = j = 0; i < ncand; i++)
+      if (j == 0 || !equal(cands[j - 1], cands[i]))
+        cands[j++] = cands[i];
+    ncand = j;
+  } else if ((d = dload(dir, 0)) != NULL) {
+    for (j = 0; j < d->n; j++)
+      if (match(d->names[j], pat))
+        cadd(d->names[j]);
+  }
+
+  if (ncand == 0)
+    return 0;
+  if (again && ncand > 1) {
+    eput("\n", 1);
+    for (i = 0; i < ncand && i < 200; i++) {
+      eput(cands[i], strlen(cands[i]));
+      eput("  ", 2);
+    }
+    if (ncand > 200)
+      eput("...", 3);
+    eput("\n", 1);
+    eput(eprompt, strlen(eprompt));
+    eflush();
+    return -1;
+  }
+
+  // Common prefix of the candidates, in place of the word if it had glob
+  // characters, else after it.
+  n = strlen(cands[0]);
+  for (i = 1; i < ncand; i++)
+    for (j = 0; j < n; j++)
+      if (cands[i][j] != cands[0][j]) {
+        n = j;
+        break;
+      }
+  if (glob && ncand > 1)
+    return 0;
+  // Start of the name in the line
+  i = w + strlen(dir);
+  memcpy(pat, cands[0], n);
+  if (ncand == 1) {
+    j = !cmd && cands[0][n + 1];
+    pat[n++] = j ? '/' : ' ';
+  }
+  if (elen - (epos - i) + n >= sizeof(ebuf) - 1)
+    return 0;
+  memmove(ebuf + i + n, ebuf + epos, elen - epos);
+  memcpy(ebuf + i, pat, n);
+  elen += i + n - epos;
+  epos = i + n;
+  return 1;
+}
+
+void eset(char *s, int n)
+{
+  if (n > sizeof(ebuf) - 2)
+    n = sizeof(ebuf) - 2;
+  memcpy(ebuf, s, n);
+  elen = epos = n;
+}
+
+/* Read a line from the terminal in raw mode, edited by keys as in emacs:
+ * ^A ^E ^B ^F and arrows move, ^H ^D ^U ^K ^W delete, up and down go
+ * through the history, ^R searches it backwards as typed, tab completes.
+ * The line is added to the history. Return 0 at end of file.
+ */
+int edline()
+{
+  struct termios tio;
+  char pat[LINSIZ];
+  unsigned char c, kb[4];
+  int col, hi, np, tabs, r, k, kn, fin, par, found;
+
+  if (tcgetattr(STDIN, &etio) < 0)
+    return -1;
+  tio = etio;
+  tio.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  tio.c_iflag &= ~(IXON | ICRNL | INLCR);
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  tcsetattr(STDIN, TCSADRAIN, &tio);
+
+  hsync();
+  hi = nhoff;
+  elen = epos = col = 0;
+  np = -1;  // length of the pattern of ^R, -1 when not searching
+  found = -1;
+  tabs = 0;
+  r = 1;
+  for (;;) {
+    if (read(STDIN, &c, 1) != 1) {
+      r = 0;
+      break;
+    }
+    tabs = c == '\t' ? tabs + 1 : 0;
+    kn = ekeys(c, kb, &fin, &par);
+
+    // Search as typed, any other key takes the line found.
+    if (np >= 0) {
+      if (c == 0x12 || (c >= ' ' && c != 0x7f) || c == 0x7f || c == 0x08) {
+        if (c == 0x7f || c == 0x08) {
+          if (np > 0)
+            np--;
+          found = -1;
+        } else if (c != 0x12 && np + kn < sizeof(pat) - 1) {
+          memcpy(pat + np, kb, kn);
+          np += kn;
+        }
+        pat[np] = '\0';
+        found = hfind(pat, c == 0x12 && found >= 0 ? found : nhoff);
+        if (found >= 0)
+          eset(hmap + hoff[found], hlinelen(found));
+        else if (c != 0x12)
+          elen = epos = 0;
+        col = edraw(col, "(search)'", pat, np, np);
+        eput("': ", 3);
+        eput(ebuf, elen);
+        eput("\033[K", 3);
+        eflush();
+        col += 3 + ecols(ebuf, elen);
+        continue;
+      }
+      np = -1;
+      col = edraw(col, "", ebuf, elen, epos);
+    }
+
+    switch (c) {
+      case '\r':
+      case '\n':
+        goto done;
+      case 0x03:  // ^C drops the line
+        elen = epos = 0;
+        eput("^C", 2);
+        eflush();
+        goto done;
+      case 0x04:  // ^D ends the input on an empty line
+        if (elen == 0) {
+          r = 0;
+          goto done;
+        }
+      del:
+        if (epos < elen) {
+          k = enext(epos);
+          memmove(ebuf + epos, ebuf + k, elen - k);
+          elen -= k - epos;
+        }
+        break;
+      case 0x01:
+        epos = 0;
+        break;
+      case 0x05:
+        epos = elen;
+        break;
+      case 0x02:
+        epos = eprev(epos);
+        break;
+      case 0x06:
+        epos = enext(epos);
+        break;
+      case 0x7f:
+      case 0x08:
+        if (epos > 0) {
+          k = eprev(epos);
+          memmove(ebuf + k, ebuf + epos, elen - epos);
+          elen -= epos - k;
+          epos = k;
+        }
+        break;
+      case 0x15:  // ^U
+        memmove(ebuf, ebuf + epos, elen - epos);
+        elen -= epos;
+        epos = 0;
+        break;
+      case 0x0b:  // ^K
+        elen = epos;
+        break;
+      case 0x17:  // ^W
+        for (k = epos; k > 0 && ebuf[k - 1] == ' '; k--)
+          continue;
+        for (; k > 0 && ebuf[k - 1] != ' '; k--)
+          continue;
+        memmove(ebuf + k, ebuf + epos, elen - epos);
+        elen -= epos - k;
+        epos = k;
+        break;
+      case 0x12:  // ^R
+        np = 0;
+        pat[0] = '\0';
+        found = -1;
+        col = edraw(col, "(search)'", "", 0, 0);
+        eput("': ", 3);
+        eflush();
+        col += 3;
+        continue;
+      case 0x10:  // ^P
+      case 0x0e:  // ^N
+        c = c == 0x10 ? 'A' : 'B';
+        goto arrow;
+      case '\t':
+        if (ecomplete(tabs > 1) < 0)
+          col = 0;
+        break;
+      case 0x1b:
+        // Keys of sequences like ESC [ 3 ~, others are ignored.
+        if (kn == 0)
+          break;
+        c = fin;
+        if (c == '~') {
+          if (par == 3)
+            goto del;
+          c = par == 1 || par == 7 ? 'H' : par == 4 || par == 8 ? 'F' : 0;
+        }
+      arrow:
+        if (c == 'C')
+          epos = enext(epos);
+        else if (c == 'D')
+          epos = eprev(epos);
+        else if (c == 'H')
+          epos = 0;
+        else if (c == 'F')
+          epos = elen;
+        else if (c == 'A' && hi > 0) {
+          hi--;
+          eset(hmap + hoff[hi], hlinelen(hi));
+        } else if (c == 'B' && hi < nhoff) {
+          if (++hi < nhoff)
+            eset(hmap + hoff[hi], hlinelen(hi));
+          else
+            elen = epos = 0;
+        }
+        break;
+      default:
+        if (c < ' ' || elen + kn >= sizeof(ebuf) - 1)
+          break;
+        memmove(ebuf + epos + kn, ebuf + epos, elen - epos);
+        memcpy(ebuf + epos, kb, kn);
+        epos += kn;
+        elen += kn;
+    }
+    col = edraw(col, "", ebuf, elen, epos);
+  }
+
+done:
+  if (np >= 0)
+    col = edraw(col, "", ebuf, elen, epos);
+  eput("\n", 1);
+  eflush();
+  tcsetattr(STDIN, TCSADRAIN, &etio);
+  ebuf[elen++] = '\n';
+  if (r)
+    hadd(ebuf, elen);
+  ep = ebuf;
+  eend = ebuf + elen;
+  return r;
+}
+
+// Built-in commands loaded by 'enable -f', in the order of loading
+struct dynbuiltin {
+  struct tash_builtin *tb;
+  struct dynbuiltin *next;
+} *dynbuiltins;
+
+struct tash_builtin *dynfind(char *s)
+{
+  struct dynbuiltin *db;
+
+  for (db = dynbuiltins; db != NULL; db = db->next)
+    if (equal(db->tb->name, s))
+      return db->tb;
+  return NULL;
+}
+
+/* Call a built-in command, of the table or loaded, in the shell with the
+ * redirections of the command in place while it runs.
+ */
+void bshell(struct builtin *bp, struct tash_builtin *tb, unsigned long *t)
+{
+  unsigned long *av;
+  int fd, ifd, ofd;
+
+  ifd = ofd = -1;
+  // What 'read' took ahead stays for the next 'read', unless STDIN changes
+  // or a loaded built-in may read it.
+  if (t[DLEF] || tb != NULL)
+    rdsync();
+  if (t[DLEF]) {
+    if ((fd = open((char *)t[DLEF], O_RDONLY)) < 0) {
+      exitval = 1;
+      prs((char *)t[DLEF]);
+      prs(": cannot open\n");
+      return;
+    }
+    ifd = fcntl(STDIN, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDIN);
+    close(fd);
+  }
+  if (t[DRIT]) {
+    fd = -1;
+    if ((t[DFLG] & FCAT) && (fd = open((char *)t[DRIT], 1)) >= 0)
+      lseek(fd, 0, SEEK_END);
+    if (fd < 0 && (fd = creat((char *)t[DRIT], 0666)) < 0) {
+      exitval = 1;
+      prs((char *)t[DRIT]);
+      prs(": cannot create\n");
+    } else {
+      ofd = fcntl(STDOUT, F_DUPFD_CLOEXEC, 10);
+      dup2(fd, STDOUT);
+      close(fd);
+    }
+  }
+
+  if (exitval == 0 && bp != NULL) {
+    bp->func(t);
+  } else if (exitval == 0) {
+    for (av = t + DCOM; *av != 0; av++)
+      continue;
+    exitval = tb->func(av - (t + DCOM), (char **)(t + DCOM));
+    fflush(NULL);
+  }
+
+  if (ifd >= 0) {
+    rdkind = rdp = rdn = 0;
+    dup2(ifd, STDIN);
+    close(ifd);
+  }
+  if (ofd >= 0) {
+    dup2(ofd, STDOUT);
+    close(ofd);
+  }
+}
+
+/* enable lists the built-in commands, and enable -f lib.so name ... loads
+ * more from a shared library, as told in builtin.h.
+ */
+void benable(unsigned long *t)
+{
+  struct tash_builtin *tb;
+  struct dynbuiltin *db;
+  unsigned long *av;
+  char sym[LINSIZ];
+  void *h;
+  int i;
+
+  av = t + DCOM + 1;
+  if (*av == 0) {
+    for (i = 0; i < BHSIZ; i++)
+      if (builtins[i].name != NULL) {
+        prs(builtins[i].name);
+        prs("\n");
       }
+    for (db = dynbuiltins; db != NULL; db = db->next) {
+      prs(db->tb->name);
+      prs(" -f\n");
+    }
+    return;
+  }
+
+  if (!equal((char *)*av, "-f") || av[1] == 0 || av[2] == 0) {
+    exitval = 1;
+    err("enable: arg count");
+    return;
+  }
+  if ((h = dlopen((char *)av[1], RTLD_NOW | RTLD_LOCAL)) == NULL) {
+    exitval = 1;
+    prs(dlerror());
+    prs("\n");
+    return;
+  }
+  for (av += 2; *av != 0; av++) {
+    snprintf(sym, sizeof(sym), "%s_builtin", (char *)*av);
+    tb = dlsym(h, sym);
+    if (tb == NULL || tb->abi != TASH_ABI || tb->func == NULL ||
+        tb->name == NULL || !equal(tb->name, (char *)*av)) {
+      exitval = 1;
+      prs((char *)*av);
+      prs(": not a built-in of this shell\n");
+      continue;
+    }
+    if (bfind(tb->name) != NULL || dynfind(tb->name) != NULL) {
+      exitval = 1;
+      prs((char *)*av);
+      prs(": already a built-in\n");
+      continue;
+    }
+    if ((db = malloc(sizeof(*db))) == NULL) {
+      exitval = 1;
+      err("Out of memory");
+      return;
+    }
+    trace("enable %s\n", tb->name);
+    db->tb = tb;
+    db->next = dynbuiltins;
+    dynbuiltins = db;
+  }
+}
+
+void execute(unsigned long *t, int *pf1, int *pf2)
+{
+  unsigned long flag;
+  unsigned long *t1;
+  char *cp1;
+  int pid, fd, tail, pv[2];
+  struct builtin *bp;
+  struct tash_builtin *tb;
+  struct bstage *b;
+  struct timespec ts;
+  cpu_set_t cs;
+  extern int errno;
+
+  if (t == NULL)
+    return;
+  tail = (t == tailt);
+
+  switch (t[DTYP]) {
 
-      if (equal(cp1, ":"))
+    case TCOM:
+      t = subst(t);
+      cp1 = (char *)t[DCOM];
+      exitval = 0;
+      /* Buid-in command, in a child like any other when piped, in
+       * background, written to more files or under timeout */
+      bp = bfind(cp1);
+      tb = bp == NULL ? dynfind(cp1) : NULL;
+      if (bp != NULL || tb != NULL) {
+        if (!(t[DFLG] & (FAND | FPIN | FPOU | FTEE)) && deadline.tv_sec == 0) {
+          bshell(bp, tb, t);
+          return;
+        }
+      } else if (bstart(t, pf1, pf2)) {
+        // Built-in stage of a pipeline runs on a thread.
         return;
+      }
 
     // Note: Here's no break! self-defined command below
+    case TIF:
+    case TWHL:
+    case TFOR:
     case TPAR:
       flag = t[DFLG];
+      // Control command runs in the shell unless piped, redirected, in background
+      // or under timeout.
+      if (t[DTYP] >= TIF && !(flag & (FAND | FPIN | FPOU)) && !t[DLEF] && !t[DRIT] &&
+          deadline.tv_sec == 0) {
+        control(t);
+        return;
+      }
+
+      // The last command of the input is run as in parathesis.
+      if (tail && !(flag & (FAND | FPIN | FPOU)) && nochild()) {
+        trace("exec %s\n", (char *)t[DCOM]);
+        flag |= FPAR;
+      }
+
+      rdsync();
       pid = 0;
-      if (!(flag & FPAR))
-        pid = fork();
+      if (!(flag & FPAR)) {
+        // A pipeline waits before its first stage, never between stages.
+        if ((flag & FAND) && !(flag & FPIN))
+          jslot();
+        pid = tfork();
+      }
+      if (pid > 0 && deadline.tv_sec != 0) {
+        tgroup(pid, flag);
+        if (ntpid < TOKSIZ)
+          tpid[ntpid++] = pid;
+      }
+      if (pid > 0 && (flag & FAND) && nbg < TOKSIZ)
+        bgpid[nbg++] = pid;
+      if (pid > 0 && (flag & FAND) && !(flag & FPOU) && njob < TOKSIZ)
+        jobpid[njob++] = pid;
       if (pid == -1) {
+        exitval = 1;
         err("try again");
         return;
       }
 
       // Parent process (shell): NON-FPAR will run here
       if (pid != 0) {
+        if (flag & (FPIN | FPOU))
+          stage++;
         // FPIN will close pipe descriptor pv[2].
         if (flag & FPIN) {
           close(pf1[0]);
@@ -586,12 +4154,36 @@ void execute(unsigned long *t, int *pf1, int *pf2)
         if (flag & FAND)
           return;
         // Note: we do not close FPOU's pv[2] here for it is to be reused by FPIN sequently.
-        if (!(flag & FPOU))
+        if (!(flag & FPOU)) {
           pwait(pid, t);
+          if (bstages != NULL)
+            bjoin();
+        }
 
         return;
       }
 
+      // Descriptors of built-in stages belong to their threads.
+      signal(SIGPIPE, SIG_DFL);
+      if (deadline.tv_sec != 0 && !(flag & FPAR))
+        setpgid(0, tpgid);
+      deadline.tv_sec = 0;
+      aqon = 0;
+      for (b = bstages; b != NULL; b = b->next) {
+        if (b->in >= 0)
+          close(b->in);
+        if (b->out >= 0)
+          close(b->out);
+      }
+
+      // Those of simple commands are already substituted by subst().
+      if (t[DTYP] != TCOM) {
+        subp = subbuf;
+        t[DLEF] = (unsigned long)wsub(t[DLEF]);
+        if (!(flag & FTEE))
+          t[DRIT] = (unsigned long)wsub(t[DRIT]);
+      }
+
       // Redirect STDIN
       if (t[DLEF]) {
         fd = open((char *)t[DLEF], 0);
@@ -605,8 +4197,8 @@ void execute(unsigned long *t, int *pf1, int *pf2)
         close(fd);
       }
 
-      // Redirect STDOUT
-      if (t[DRIT]) {
+      // Redirect STDOUT, more files are fanned out after the pipe in
+      if (t[DRIT] && !(flag & FTEE)) {
         if (flag & FCAT) {
           fd = open((char *)t[DRIT], 1);
           if (fd >= 0) {
@@ -634,6 +4226,9 @@ f1:
         close(pf1[1]);
       }
 
+      if (flag & FTEE)
+        fanout((unsigned long *)t[DRIT]);
+
       // Redirect pipe out
       if (flag & FPOU) {
         //close(STDOUT);
@@ -656,47 +4251,40 @@ f1:
         signal(SIGQUIT, SIG_DFL);
       }
 
+      if (flag & (FPIN | FPOU))
+        place(stage);
+
       // TPAR recursive, exit immediately
       if (t[DTYP] == TPAR) {
         // Push down attribute
         if ((t1 = (unsigned long *)t[DSPR]) != NULL)
           t1[DFLG] |= flag & FINT;
         execute(t1, NULL, NULL);
-        exit(0);
+        exit(exitval);
       }
 
-      glob = 0;
-      scan(t, &tglob);
-      if (glob) {
-        t[DSPR] = (unsigned long)"glob";//"/etc/glob";
-        execv((char *)t[DSPR], (char **)(t + DSPR));
-        prs("glob: cannot execute\n");
-        exit(-1);
+      // Control command in its own process
+      if (t[DTYP] != TCOM) {
+        control(t);
+        exit(exitval);
       }
 
-      scan(t, &trim);
-      *linep = '\0';
-      texec((char *)t[DCOM], t);
-      cp1 = linep;
-      cp2 = "/usr/bin/";
-      while ((*cp1 = *cp2++) != '\0')
-        cp1++;
-      cp2 = (char *)t[DCOM];
-      while ((*cp1++ = *cp2++) != '\0')
-        continue;
-      texec(linep + 4, t);
-      texec(linep, t);
-      prs((char *)t[DCOM]);
-      err(": not found");
-      exit(-1);
+      cexec(t);
 
     // Note: Here's no break!
     case TFIL:
       flag = t[DFLG];
+      // The first pipe of a pipeline
+      if (!(flag & FPIN)) {
+        stage = 0;
+        cpuauto(&cs);
+      }
       pipe(pv);
+      if (setnum("pipesize") > 0)
+        pipesize(pv);
       // Push down filter attribute
       t1 = (unsigned long *)t[DLEF];
-      t1[DFLG] |= FPOU | (flag & (FPIN | FINT | FPRS));
+      t1[DFLG] |= FPOU | (flag & (FPIN | FINT | FAND | FPRS));
       execute(t1, pf1, pv);
       t1 = (unsigned long *)t[DRIT];
       t1[DFLG] |= FPIN | (flag & (FPOU | FINT | FAND | FPRS));
@@ -705,7 +4293,7 @@ f1:
 
     case TLST:
       // Push down list attribute.
-      flag = t[DFLG] | FINT;
+      flag = t[DFLG] & FINT;
       if ((t1 = (unsigned long *)t[DLEF]) != NULL)
         t1[DFLG] |= flag;
       execute(t1, NULL, NULL);
@@ -713,13 +4301,151 @@ f1:
         t1[DFLG] |= flag;
       execute(t1, NULL, NULL);
       return;
+
+    case TTIM:
+      flag = t[DFLG];
+      subp = subbuf;
+      if (!deadl(wsub(t[DSPR]), &ts)) {
+        exitval = 1;
+        err("timeout: bad duration");
+        return;
+      }
+      // In background the pipeline is waited for by a shell of its own.
+      if (flag & FAND) {
+        rdsync();
+        jslot();
+        if ((pid = tfork()) == -1) {
+          exitval = 1;
+          err("try again");
+          return;
+        }
+        if (pid != 0) {
+          if (nbg < TOKSIZ)
+            bgpid[nbg++] = pid;
+          if (njob < TOKSIZ)
+            jobpid[njob++] = pid;
+          if (flag & FPRS) {
+            prn(pid);
+            prs("\n");
+          }
+          return;
+        }
+        nbg = 0;
+        njob = 0;
+        aqon = 0;
+      }
+      if ((t1 = (unsigned long *)t[DCOM]) != NULL)
+        t1[DFLG] |= flag & FINT;
+      ntpid = 0;
+      tpgid = 0;
+      deadline = ts;
+      execute(t1, NULL, NULL);
+      deadline.tv_sec = 0;
+      tungroup();
+      if (flag & FAND)
+        exit(exitval);
+      return;
+  }
+}
+
+void control(unsigned long *t)
+{
+  unsigned long flag;
+  unsigned long *t1;
+  char **p;
+  int val;
+
+  flag = t[DFLG] & FINT;
+  val = 0;
+
+  switch (t[DTYP]) {
+
+    case TIF:
+      if ((t1 = (unsigned long *)t[DSPR]) != NULL)
+        t1[DFLG] |= flag;
+      execute(t1, NULL, NULL);
+      t1 = (unsigned long *)t[exitval == 0 ? DCOM : DCOM + 1];
+      if (t1 != NULL) {
+        t1[DFLG] |= flag;
+        execute(t1, NULL, NULL);
+        val = exitval;
+      }
+      break;
+
+    case TWHL:
+      for (;;) {
+        if ((t1 = (unsigned long *)t[DSPR]) != NULL)
+          t1[DFLG] |= flag;
+        execute(t1, NULL, NULL);
+        if (exitval != 0)
+          break;
+        if ((t1 = (unsigned long *)t[DCOM]) != NULL)
+          t1[DFLG] |= flag;
+        execute(t1, NULL, NULL);
+        val = exitval;
+      }
+      break;
+
+    case TFOR:
+      for (p = (char **)(t + DCOM + 1); *p != NULL; p++) {
+        subp = subbuf;
+        setvar((char *)t[DSPR], dosub(*p));
+        if ((t1 = (unsigned long *)t[DCOM]) != NULL)
+          t1[DFLG] |= flag;
+        execute(t1, NULL, NULL);
+        val = exitval;
+      }
+      break;
+  }
+
+  exitval = val;
+}
+
+/* Commands from a pipe are taken a line at a time by rdpeek(), in one
+ * read(2) instead of one a byte, and never past the line, so commands
+ * reading STDIN get the rest of it as before. Memory is that of a line
+ * however long the input. The pipe is grown to 'set pipesize', so that
+ * what writes the commands is held back less while they run.
+ */
+char inbuf[LINSIZ];
+char *inp;
+char *ine;
+int inpipe;
+long insize;
+
+int inbyte(unsigned char *c)
+{
+  int n, pv[2];
+
+  if (inpipe) {
+    if (inp == ine) {
+      if ((n = setnum("pipesize")) > 0 && n != insize) {
+        insize = n;
+        pv[0] = pv[1] = STDIN;
+        pipesize(pv);
+      }
+      if ((n = rdpeek(inbuf, sizeof(inbuf))) <= 0)
+        return 0;
+      inp = inbuf;
+      ine = inbuf + n;
+    }
+    *c = *inp++;
+    return 1;
   }
+  COUNT(SREAD, 1);
+  return read(STDIN, c, 1) == 1;
 }
 
 int readc()
 {
-  int cc;
-  char c;
+  unsigned char c;
+
+  // Script of the '.' command, which ends with '\n' for good
+  if (srcp) {
+    if (srcp == srcend)
+      return '\n';
+    return (unsigned char)*srcp++;
+  }
   
   // Option -c
   if (arginp) {
@@ -729,27 +4455,43 @@ int readc()
       c = '\n';
       arginp = (void *)1;
     }
-    return (int)c;
+    return c;
   }
 
   // Option -t
   if (onelflg == 1)
     exit(0);
-  if (read(STDIN, &cc, 1) != 1)
+  if (rdp < rdn || aqpend)
+    rdsync();
+  // Line edited on the terminal
+  if (hist) {
+    if (ep == eend && (hist = edline()) == 0)
+      exit(0);
+    if (hist > 0) {
+      c = *ep++;
+      if (c == '#')
+        while (c != '\n')
+          c = *ep++;
+      return c;
+    }
+  }
+  if (!inbyte(&c))
     exit(-1);
-  if (cc == '#')
-    while (cc != '\n')
-      if (read(STDIN, &cc, 1) != 1)
+  if (c == '#')
+    while (c != '\n')
+      if (!inbyte(&c))
         exit(-1);
-  if (cc == '\n' && onelflg)
+  if (hist)
+    hput(c);
+  if (c == '\n' && onelflg)
     onelflg--;
 
-  return cc;
+  return c;
 }
 
-char getch()
+int getch()
 {
-  char c;
+  int c;
 
   if (peekc) {
     c = peekc;
@@ -762,6 +4504,8 @@ char getch()
     while ((c = getch()) != '\n')
       continue;
     tokp += 10;
+    if (aqquiet)
+      longjmp(aqjmp, 1);
     err("Too many toks");
     overflow++;
     return c;
@@ -772,20 +4516,13 @@ char getch()
     while ((c = getch()) != '\n')
       continue;
     linep += 10;
+    if (aqquiet)
+      longjmp(aqjmp, 1);
     err("Too many characters");
     overflow++;
     return c;
   }
 
-GET:
-  // '$'
-  if (dolp) {
-    c = *dolp++;
-    if (c != '\0')
-      return c;
-    dolp = 0;
-  }
-
   c = readc();
 
   // '\'
@@ -796,29 +4533,16 @@ GET:
     return (c | QUOTE);
   }
 
-  if (c == '$') {
-    c = readc();
-    // '$n'
-    if (c >= '0' || c <= '9') {
-      if (c - '0' < dolc)
-        dolp = dolv[c - '0'];
-      goto GET;
-    }
-    // '$$'
-    if (c == '$') {
-      dolp = pidp;
-      goto GET;
-    }
-  }
-
-  return (c & 0x7f);
+  // Note: '$' is left in the token and substituted in execute().
+  return c;
 }
 
 
 void token()
 {
-  char c, c1;
+  int c, c1, n;
 
+  linep = tbegin(linep);
   *tokp++ = linep;
   
 TOKEN:
@@ -836,12 +4560,24 @@ TOKEN:
         if (c == '\n') {
           error++;
           peekc = c;  // '\n' should be pushed back for next session
+          linep = tend(linep);
           return;
         }
-        *linep++ = c | QUOTE;
+        // '$' is still substituted within double quotes.
+        if (c == '$' && c1 == '"')
+          linep = tput(linep, c);
+        else
+          linep = tput(linep, c | QUOTE);
       }
       goto SEPERATE;
 
+    case '#':
+      // Comment in a script of '.' up to the end of line
+      if (srcp == NULL)
+        break;
+      while ((c = readc()) != '\n')
+        continue;
+      // Note: Here's no break!
     case '&':
     case ';':
     case '<':
@@ -851,8 +4587,9 @@ TOKEN:
     case '|':
     case '^':
     case '\n':
-      *linep++ = c;
-      *linep++ = '\0';
+      linep = tput(linep, c);
+      tokflg |= TKMET;
+      linep = tend(linep);
       return;
   }
 
@@ -861,64 +4598,447 @@ TOKEN:
 
 SEPERATE:
   for (;;) {
+    // Option -c, copy a run of ordinary characters at a time.
+    if (arginp != NULL && arginp != (void *)1 && srcp == NULL && peekc == 0 && linep < elinep) {
+      n = ordlen(arginp, elinep - linep);
+      memcpy(linep, arginp, n);
+      linep += n;
+      arginp += n;
+    }
+
     c = getch();
+    // Qualifiers after a glob pattern, as in *.c(.om), stay in the word.
+    if (c == '(' && (tokflg & TKGLB)) {
+      linep = tput(linep, c);
+      while ((c = getch()) != ')') {
+        if (c == '\n') {
+          error++;
+          peekc = c;
+          linep = tend(linep);
+          return;
+        }
+        linep = tput(linep, c);
+      }
+      linep = tput(linep, c);
+      continue;
+    }
     // Here is token seperator.
-    if (any(c, " '\"\t;&<>()|^\n")) {
+    if (!(c & QUOTE) && (ctab[c] & CSEP)) {
       peekc = c;  // Push back as next token
-      if (any(c, "\"'"))
+      if (ctab[c] & CQUO)
         goto TOKEN;
-      *linep++ = '\0';
+      linep = tend(linep);
       return;
     }
-    *linep++ = c;
+    linep = tput(linep, c);
   }
 }
 
-void session()
+/* Read one command line, continued while a control command is left open,
+ * and parse it within the buffers set up by the caller.
+ */
+unsigned long *readcmd(char **tv)
 {
   char *cp;
   unsigned long *t;
+  int l;
 
-  tokp = toks;
-  etokp = toks + TOKSIZ - 5;
-  linep = line;
-  elinep = line + LINSIZ - 5;
   error = 0;
   overflow = 0;
   
-  // End of one session when the first character of line buffer is '\n'
+  /* End of one session when the first character of line buffer is '\n'
+   * and no control command is left open.
+   */
+  l = 0;
   do {
-    cp = linep;
     token();
-  } while (*cp != '\n');
+    cp = *(tokp - 1);
+    l += nest(tokp - 1, tv);
+    if (TOKC(cp) == '\n' && l > 0) {
+      // End of script
+      if (srcp != NULL && srcp == srcend) {
+        error++;
+        break;
+      }
+      if (prompt != 0 && srcp == NULL)
+        prs(eprompt = "> ");
+    }
+  } while (TOKC(cp) != '\n' || l > 0);
 
-  treep = trebuf;
-  treeend = (unsigned long *)trebuf + TRESIZ;
+  if (overflow)
+    return NULL;
+
+  t = NULL;
+  if (error == 0) {
+    //setexit();
+    //if (error)
+      //return;
+    t = parse(tv, tokp);
+  }
+
+  if (error) {
+    if (aqquiet)
+      longjmp(aqjmp, 1);
+    err("Syntax error!");
+    return NULL;
+  }
+  return t;
+}
+
+/* Move a parsed command out of the buffers into memory of its own. Any word
+ * of the tree which points into the line or the tree is rebased.
+ */
+unsigned long *keep(unsigned long *t, char *l, unsigned long *t0)
+{
+  unsigned long *nt, w;
+  char *nl;
+  long i, m, n;
+
+  m = treep - t0;
+  n = linep - l;
+  if ((nt = malloc(m * sizeof(long) + n)) == NULL) {
+    err("Out of memory");
+    return NULL;
+  }
+  nl = (char *)(nt + m);
+  memcpy(nl, l, n);
+
+  for (i = 0; i < m; i++) {
+    w = t0[i];
+    if (w >= (unsigned long)l && w < (unsigned long)linep)
+      w += nl - l;
+    else if (w >= (unsigned long)t0 && w < (unsigned long)treep)
+      w += (char *)nt - (char *)t0;
+    nt[i] = w;
+  }
+  return nt + (t - t0);
+}
+
+/* Parse all commands of a script read at once, with buffers of its own so
+ * that the command line running the '.' command is left intact.
+ */
+void srcparse(struct script *s, int fd)
+{
+  char sline[LINSIZ];
+  char *stoks[TOKSIZ];
+  unsigned long stree[TRESIZ];
+  char *buf, *osrcp, *osrcend, *olinep, *oelinep, **otokp, **oetokp;
+  unsigned long *t, *otreep, *otreeend;
+  int n, m, opeekc;
+
+  s->cmds = NULL;
+  s->ncmd = 0;
+  if ((buf = malloc(s->size + 1)) == NULL) {
+    err("Out of memory");
+    return;
+  }
+  for (n = 0; n < s->size; n += m)
+    if ((m = read(fd, buf + n, s->size - n)) <= 0)
+      break;
 
-  if (!overflow) {
-    if (error == 0) {
-      //setexit();
-      //if (error)
-        //return;
-      t = parse(toks, tokp);
+  osrcp = srcp;
+  osrcend = srcend;
+  olinep = linep;
+  oelinep = elinep;
+  otokp = tokp;
+  oetokp = etokp;
+  otreep = treep;
+  otreeend = treeend;
+  opeekc = peekc;
+
+  srcp = buf;
+  srcend = buf + n;
+  peekc = 0;
+  while (srcp != srcend) {
+    tokp = stoks;
+    etokp = stoks + TOKSIZ - 5;
+    linep = sline;
+    elinep = sline + LINSIZ - LINSIZ / 8 - 8;
+    treep = stree;
+    treeend = stree + TRESIZ;
+    if ((t = readcmd(stoks)) == NULL || (t = keep(t, sline, stree)) == NULL)
+      continue;
+    if ((s->ncmd & 15) == 0) {
+      s->cmds = realloc(s->cmds, (s->ncmd + 16) * sizeof(*s->cmds));
+      if (s->cmds == NULL) {
+        err("Out of memory");
+        s->ncmd = 0;
+        break;
+      }
     }
+    s->cmds[s->ncmd++] = t;
+  }
 
-    if (error) {
-      err("Syntax error!");
-    } else {
-      execute(t, NULL, NULL);
+  srcp = osrcp;
+  srcend = osrcend;
+  linep = olinep;
+  elinep = oelinep;
+  tokp = otokp;
+  etokp = oetokp;
+  treep = otreep;
+  treeend = otreeend;
+  peekc = opeekc;
+  error = 0;
+  overflow = 0;
+  free(buf);
+}
+
+/* The '.' command runs a script in the shell. A script is parsed once and
+ * kept until its file is changed, so sourcing it in a loop costs no more
+ * than a stat(2). Commands of an old version are never freed since they
+ * may be running.
+ */
+void source(char *path)
+{
+  struct script *s;
+  struct stat st;
+  unsigned long **cmds;
+  int fd, i, n;
+
+  if ((fd = open(path, 0)) < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0)
+      close(fd);
+    exitval = 1;
+    prs(path);
+    err(": cannot open");
+    return;
+  }
+
+  for (s = scripts; s != NULL; s = s->next)
+    if (equal(s->path, path))
+      break;
+  if (s == NULL) {
+    if ((s = malloc(sizeof(*s))) == NULL || (s->path = strdup(path)) == NULL) {
+      close(fd);
+      exitval = 1;
+      err("Out of memory");
+      return;
+    }
+    s->ncmd = -1;
+    s->next = scripts;
+    scripts = s;
+  }
+  if (s->ncmd < 0 || s->dev != st.st_dev || s->ino != st.st_ino ||
+      s->size != st.st_size || s->mtime.tv_sec != st.st_mtim.tv_sec ||
+      s->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->size = st.st_size;
+    s->mtime = st.st_mtim;
+    trace(". %s: parse\n", path);
+    srcparse(s, fd);
+  }
+  close(fd);
+
+  if (srcdepth >= 32) {
+    exitval = 1;
+    err(".: too deep");
+    return;
+  }
+  srcdepth++;
+  exitval = 0;
+  cmds = s->cmds;
+  n = s->ncmd;
+  for (i = 0; i < n; i++)
+    execute(cmds[i], NULL, NULL);
+  srcdepth--;
+}
+
+/* The last simple command of the last command line needs no fork when
+ * nothing follows, with -c or -t, or at the end of a script file.
+ */
+unsigned long *lastcmd(unsigned long *t)
+{
+  struct stat st;
+
+  if (prompt != 0 || (arginp != (void *)1 && onelflg != 1 &&
+      (arginp != NULL || onelflg || fstat(STDIN, &st) < 0 ||
+       !S_ISREG(st.st_mode) || (aqon ? aqpos : lseek(STDIN, 0, SEEK_CUR)) != st.st_size)))
+    return NULL;
+  while (t != NULL && t[DTYP] == TLST)
+    t = (unsigned long *)(t[DRIT] ? t[DRIT] : t[DLEF]);
+  if (t == NULL || t[DTYP] != TCOM)
+    return NULL;
+  return t;
+}
+
+/* While a command of a script file runs, parse the sessions which follow
+ * it into a queue. The file is read by pread(2) so its offset is left to
+ * the command, a block at a time, with comments taken out as readc() does.
+ * Only whole sessions are kept, and an error stops it to be found again in
+ * turn.
+ */
+void ahead()
+{
+  static char buf[65536], fbuf[65536];
+  static int fofs[65536];
+  static long fbase, stuck = -1;
+  static int fpos, fn;
+  char sline[LINSIZ];
+  char *stoks[TOKSIZ];
+  unsigned long stree[TRESIZ];
+  char *osrcp, *osrcend, *olinep, *oelinep, **otokp, **oetokp;
+  unsigned long *t, *mem, *otreep, *otreeend;
+  volatile int k;
+  int i, n, m, opeekc;
+  long d;
+
+  if (aqn >= AQMAX)
+    return;
+  // Text left in the block follows the queue unless it was dropped.
+  if (aqn == 0 && aqend != aqpos) {
+    aqend = aqpos;
+    fpos = fn = 0;
+  }
+  if (aqend == stuck)
+    return;
+  if (fpos == fn) {
+    fbase = aqend;
+    fpos = fn = 0;
+    if ((n = pread(STDIN, buf, sizeof(buf), fbase)) <= 0)
+      return;
+    COUNT(SREAD, 1);
+    for (m = n; m > 0 && buf[m - 1] != '\n'; m--)
+      continue;
+    for (i = 0; i < m; i++) {
+      if (buf[i] == '#')
+        while (buf[i] != '\n')
+          i++;
+      fbuf[fn] = buf[i];
+      fofs[fn++] = i;
+    }
+    if (fn == 0) {
+      stuck = aqend;
+      return;
+    }
+  }
+
+  osrcp = srcp;
+  osrcend = srcend;
+  olinep = linep;
+  oelinep = elinep;
+  otokp = tokp;
+  oetokp = etokp;
+  otreep = treep;
+  otreeend = treeend;
+  opeekc = peekc;
+
+  srcp = fbuf + fpos;
+  srcend = fbuf + fn;
+  peekc = 0;
+  aqquiet = 1;
+  k = 0;
+  if (setjmp(aqjmp) == 0) {
+    while (srcp != srcend && aqn < AQMAX) {
+      tokp = stoks;
+      etokp = stoks + TOKSIZ - 5;
+      linep = sline;
+      elinep = sline + LINSIZ - LINSIZ / 8 - 8;
+      treep = stree;
+      treeend = stree + TRESIZ;
+      error = 0;
+      overflow = 0;
+      if ((t = readcmd(stoks)) != NULL) {
+        d = t - stree;
+        if ((t = keep(t, sline, stree)) == NULL)
+          break;
+      }
+      mem = t != NULL ? t - d : NULL;
+      fpos = srcp - fbuf;
+      i = (aqh + aqn) % AQMAX;
+      aq[i] = t;
+      aqmem[i] = mem;
+      aqoff[i] = aqend = fbase + fofs[fpos - 1] + 1;
+      aqn++;
+      k++;
+    }
+  } else if (fpos == 0) {
+    // Not even one session in a block
+    stuck = aqend;
+  } else {
+    // The rest is read again from the session it stopped at.
+    fpos = fn;
+  }
+  aqquiet = 0;
+  trace("ahead: %d\n", k);
+
+  srcp = osrcp;
+  srcend = osrcend;
+  linep = olinep;
+  elinep = oelinep;
+  tokp = otokp;
+  etokp = oetokp;
+  treep = otreep;
+  treeend = otreeend;
+  peekc = opeekc;
+  error = 0;
+  overflow = 0;
+}
+
+void aqdrop()
+{
+  for (; aqn > 0; aqn--) {
+    free(aqmem[aqh]);
+    aqh = (aqh + 1) % AQMAX;
+  }
+  aqh = 0;
+}
+
+void session()
+{
+  unsigned long *t, *mem;
+
+  // A session parsed ahead, unless someone read the input meanwhile
+  if (aqn > 0) {
+    if (lseek(STDIN, 0, SEEK_CUR) == aqfpos) {
+      t = aq[aqh];
+      mem = aqmem[aqh];
+      aqpos = aqoff[aqh];
+      aqpend = 1;
+      aqh = (aqh + 1) % AQMAX;
+      aqn--;
+      if (t != NULL) {
+        tailt = lastcmd(t);
+        execute(t, NULL, NULL);
+      }
+      free(mem);
+      return;
     }
+    trace("ahead: drop %d\n", aqn);
+    aqdrop();
+  }
+
+  tokp = toks;
+  etokp = toks + TOKSIZ - 5;
+  linep = line;
+  elinep = line + LINSIZ - LINSIZ / 8 - 8;  // Room for bitmap of the last token
+  treep = trebuf;
+  treeend = (unsigned long *)trebuf + TRESIZ;
+
+  t = readcmd(toks);
+  if (aqon)
+    aqpos = aqfpos = lseek(STDIN, 0, SEEK_CUR);
+  if (t != NULL) {
+    tailt = lastcmd(t);
+    execute(t, NULL, NULL);
   }
 }
 
 int main(int argc, char **argv)
 {
+  struct stat st;
   int i, pid;
 
+  ctinit();
   for (i = STDERR; i < 16; i++)
     close(i);
   dup2(STDOUT, STDERR);
-  for (i = 4; i >= 0; i--) {
+  statinit();
+#ifndef NDEBUG
+  bcheck();
+#endif
+  pid = getpid();
+  for (i = 6; i >= 0; i--) {
     pidp[i] = pid % 10 + '0';
     pid /= 10;
   }
@@ -947,6 +5067,11 @@ int main(int argc, char **argv)
     }
   }
 
+  // Built-in stages see EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
+  // Line of 'read' is all the parent sees taken from STDIN.
+  atexit(rdsync);
+
   if (**argv == '-') {
     setintr++;
     signal(SIGINT, SIG_IGN);
@@ -955,11 +5080,21 @@ int main(int argc, char **argv)
 
   dolv = argv + 1;
   dolc = argc - 1;
+  // Lines typed on a terminal are kept in the history.
+  hist = prompt != NULL && isatty(STDIN);
+  // Sessions of a script file are parsed ahead while its commands run, of
+  // any other regular file only with 'set readahead 1'.
+  if (arginp == NULL && onelflg == 0 && fstat(STDIN, &st) == 0 && S_ISREG(st.st_mode))
+    aqon = prompt == NULL ? 1 : 2;
+  else if (arginp == NULL && onelflg == 0 && !hist && fstat(STDIN, &st) == 0 &&
+      S_ISFIFO(st.st_mode) && pipe2(rdpv, O_CLOEXEC) == 0)
+    inpipe = 1;
 
   for (;;) {
     if (prompt != 0)
-      prs(prompt);
-    peekc = getch();  // Pre-read one character
+      prs(eprompt = prompt);
+    if (aqn == 0)
+      peekc = getch();  // Pre-read one character
     session();
   }
 
@@ -0,0 +1,24 @@
+# Helpers of the regression tests, sourced by tests/*.sh with the shell to
+# test in $TASH, ./tash by default, run from the top of the tree by 'make test'.
+# Scripts run in a directory of their own with a copy of glob.
+
+TASH=${TASH:-./tash}
+case $TASH in
+  /*) ;;
+  *) TASH=$(pwd)/$TASH ;;
+esac
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+cp glob $TMP
+cd $TMP
+fail=0
+
+# Compare output $2 of test $1 with what is expected in $3
+check() {
+  if [ "$2" = "$3" ]; then
+    printf '%-40s ok\n' "$1"
+  else
+    printf '%-40s FAILED\n  expected: %s\n  got:      %s\n' "$1" "$3" "$2"
+    fail=1
+  fi
+}
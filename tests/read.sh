@@ -0,0 +1,11 @@
+# What 'read' takes ahead of a file on STDIN is given back to whatever reads
+# it next.
+
+. tests/common.sh
+
+printf 'l%d\n' 1 2 3 4 5 6 7 8 9 10 > f
+check "'cat -' on a thread after 'read'" "$($TASH -c 'read a; cat - | wc -l' < f)" 9
+check "'cat' in a child after 'read'" "$($TASH -c 'read a; read b; /bin/cat | wc -l' < f)" 8
+check "'read' after 'read'" "$($TASH -c 'read a; read b; echo $b' < f)" l2
+
+exit $fail
@@ -0,0 +1,34 @@
+# '$n' and '$name' are substituted in every word which is used, not only in
+# the arguments.
+
+. tests/common.sh
+
+echo 'echo hi > $1' > s
+$TASH s out
+check "redirection '> \$1'" "$(cat out 2>/dev/null)" hi
+
+printf 'cat < $1 > $2\necho again >> $1\n' > s
+$TASH s out c
+check "redirections '< \$1', '>> \$1'" "$(cat c out)" "hi
+hi
+again"
+
+printf 'set f a\necho x > $f > $1\ncat $f $1\n' > s
+check "fan-out files" "$($TASH s b)" "x
+x"
+
+printf 'set f a\n(echo p) > $f\nif true; then echo c; fi >> $f\ncat $f\n' > s
+check "redirections of control commands" "$($TASH s)" "p
+c"
+
+printf 'timeout $1 sleep 5\necho $?\n' > s
+check "timeout duration" "$($TASH s 1)" 124
+
+touch zz1 zz2
+check "value in double quotes not globbed" "$($TASH -c "set p 'zz*'; echo \"\$p\"")" "zz*"
+check "value out of quotes globbed" "$($TASH -c "set p 'zz*'; echo \$p")" "zz1 zz2"
+check "name ends with double quotes" "$($TASH -c "set p a; echo \"\$p\"x")" ax
+printf 'echo "$1" $1\n' > s
+check "'\$1' in double quotes" "$($TASH s 'zz*')" "zz* zz1 zz2"
+
+exit $fail